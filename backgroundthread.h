@@ -0,0 +1,22 @@
+#pragma once
+
+#include <thread>
+#include <utility>
+
+extern "C" {
+#include <signal.h>
+#include <pthread.h>
+}
+
+// Starts a thread with all signals blocked, they should go to the main loop so
+// it wakes up.
+template<typename... Args>
+static std::thread startBackgroundThread(Args&&... args)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::thread thread(std::forward<Args>(args)...);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    return thread;
+}
@@ -0,0 +1,196 @@
+// Compares the cost from wakeup until we have the key event for the old
+// select() loop and the epoll and io_uring based event loops, with an
+// increasing number of (fake) devices. Every device is a pipe, one random pipe
+// gets an input_event per iteration, like a keyboard would.
+
+static bool s_verbose = false;
+
+#include "eventloop.h"
+#include "uringeventloop.h"
+
+#include <vector>
+#include <chrono>
+#include <random>
+
+extern "C" {
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+}
+
+static constexpr int s_iterations = 20000;
+
+struct Pipes
+{
+    Pipes(const int count)
+    {
+        for (int i=0; i<count; i++) {
+            int fds[2];
+            if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+                perror("Failed to create pipe");
+                break;
+            }
+            readFds.push_back(fds[0]);
+            writeFds.push_back(fds[1]);
+        }
+    }
+
+    ~Pipes()
+    {
+        for (const int fd : readFds) close(fd);
+        for (const int fd : writeFds) close(fd);
+    }
+
+    std::vector<int> readFds;
+    std::vector<int> writeFds;
+};
+
+static bool send(const int fd)
+{
+    input_event event = {};
+    event.type = EV_KEY;
+    event.code = KEY_A;
+    if (write(fd, &event, sizeof(event)) != sizeof(event)) {
+        perror("Failed to write");
+        return false;
+    }
+    return true;
+}
+
+static void consume(const int fd)
+{
+    input_event events[64];
+    if (read(fd, events, sizeof(events)) != sizeof(input_event)) {
+        perror("Unexpected read");
+    }
+}
+
+// Same as what main() used to do, rebuild the set, wait, and scan everything
+static double benchSelect(const Pipes &pipes)
+{
+    std::mt19937 rng(1337);
+    std::uniform_int_distribution<size_t> dist(0, pipes.readFds.size() - 1);
+
+    std::chrono::nanoseconds total(0);
+    fd_set fdset;
+    for (int i=0; i<s_iterations; i++) {
+        if (!send(pipes.writeFds[dist(rng)])) {
+            return -1;
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        FD_ZERO(&fdset);
+        int maxFd = 3;
+        for (const int fd : pipes.readFds) {
+            FD_SET(fd, &fdset);
+            maxFd = std::max(maxFd, fd);
+        }
+        if (select(maxFd + 1, &fdset, 0, 0, nullptr) != 1) {
+            perror("Failed during select");
+            return -1;
+        }
+        for (const int fd : pipes.readFds) {
+            if (FD_ISSET(fd, &fdset)) {
+                consume(fd);
+            }
+        }
+        total += std::chrono::steady_clock::now() - start;
+    }
+    return double(total.count()) / s_iterations;
+}
+
+static double benchEpoll(const Pipes &pipes)
+{
+    std::mt19937 rng(1337);
+    std::uniform_int_distribution<size_t> dist(0, pipes.readFds.size() - 1);
+
+    EpollEventLoop eventLoop;
+    for (const int fd : pipes.readFds) {
+        eventLoop.add(fd);
+    }
+
+    std::chrono::nanoseconds total(0);
+    for (int i=0; i<s_iterations; i++) {
+        if (!send(pipes.writeFds[dist(rng)])) {
+            return -1;
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const int events = eventLoop.wait(-1);
+        if (events != 1) {
+            perror("Failed waiting for events");
+            return -1;
+        }
+        consume(eventLoop.readyFds[0]);
+        total += std::chrono::steady_clock::now() - start;
+    }
+    return double(total.count()) / s_iterations;
+}
+
+// The events are already read when it wakes us up
+static double benchUring(const Pipes &pipes)
+{
+    std::mt19937 rng(1337);
+    std::uniform_int_distribution<size_t> dist(0, pipes.readFds.size() - 1);
+
+    UringEventLoop eventLoop;
+    if (!eventLoop.isValid()) {
+        return -1;
+    }
+    for (const int fd : pipes.readFds) {
+        eventLoop.addDevice(fd);
+    }
+
+    std::chrono::nanoseconds total(0);
+    for (int i=0; i<s_iterations; i++) {
+        if (!send(pipes.writeFds[dist(rng)])) {
+            return -1;
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const int events = eventLoop.wait(-1);
+        if (events != 1) {
+            perror("Failed waiting for events");
+            return -1;
+        }
+        input_event event;
+        if (eventLoop.read(eventLoop.readyFds[0], 0, &event, 1) != 1) {
+            perror("Unexpected read");
+        }
+        total += std::chrono::steady_clock::now() - start;
+    }
+    return double(total.count()) / s_iterations;
+}
+
+int main()
+{
+    // Need two fds per device
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    puts("devices   select (ns)   epoll (ns)   io_uring (ns)");
+    for (const int count : { 1, 8, 32, 128, 256, 500, 2000, 8000 }) {
+        Pipes pipes(count);
+        if (int(pipes.readFds.size()) != count) {
+            printf("%7d   (not enough file descriptors, stopping)\n", count);
+            break;
+        }
+
+        // select() can't handle anything above FD_SETSIZE
+        const bool canSelect = pipes.writeFds.back() < FD_SETSIZE;
+        const double selectTime = canSelect ? benchSelect(pipes) : -1;
+        const double epollTime = benchEpoll(pipes);
+        const double uringTime = benchUring(pipes);
+        char selectColumn[32] = "n/a";
+        char uringColumn[32] = "n/a";
+        if (canSelect) snprintf(selectColumn, sizeof(selectColumn), "%.0f", selectTime);
+        if (uringTime >= 0) snprintf(uringColumn, sizeof(uringColumn), "%.0f", uringTime);
+        printf("%7d   %11s   %10.0f   %13s\n", count, selectColumn, epollTime, uringColumn);
+    }
+    return 0;
+}
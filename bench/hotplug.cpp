@@ -0,0 +1,466 @@
+// Hotplug storm: runs the daemon against a fake udev directory (see
+// UdevConnection) and adds and removes fake keyboards as fast as it can, while
+// keys are being pressed on them and on two keyboards that stay.
+//
+// Usage: hotplug [path to shortcut-satan [more options for it, e. g. --pipeline]]
+//
+// It checks that:
+//  - a shortcut still fires quickly while the storm is going on (the time it
+//    takes is how long the loop stalls),
+//  - a shortcut held down across the storm, with the modifier on one keyboard
+//    and the key on another, still fires,
+//  - we don't leak any fds, and memory doesn't keep growing,
+//  - every keyboard that's added is opened, also when a burst of them comes
+//    in at once (checked with the control socket).
+
+#include "histogram.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+
+extern "C" {
+#include <linux/input.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+}
+
+static constexpr int s_cycles = 5000;
+static constexpr size_t s_maxTransient = 16;
+static constexpr int s_probeEvery = 50;
+static constexpr int s_spanEvery = 500;
+static constexpr int s_timeoutMs = 2000;
+static constexpr size_t s_burst = 10;
+
+static const uint16_t s_randomKeys[] = { KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_LEFTMETA };
+
+struct FakeKeyboard
+{
+    FakeKeyboard(const std::string &devicePath) : path(devicePath)
+    {
+        if (mkfifo(path.c_str(), 0600) == -1) {
+            perror(("Failed to create " + path).c_str());
+            return;
+        }
+        // Read-write, so it doesn't care if the daemon has opened it yet
+        fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            perror(("Failed to open " + path).c_str());
+        }
+    }
+
+    ~FakeKeyboard()
+    {
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(path.c_str());
+    }
+
+    FakeKeyboard(const FakeKeyboard &) = delete;
+    FakeKeyboard &operator=(const FakeKeyboard &) = delete;
+
+    // What a keyboard sends for a key press or release
+    void key(const uint16_t code, const int32_t value)
+    {
+        input_event events[3] = {};
+        events[0].type = EV_MSC;
+        events[0].code = MSC_SCAN;
+        events[0].value = code;
+        events[1].type = EV_KEY;
+        events[1].code = code;
+        events[1].value = value;
+        events[2].type = EV_SYN;
+        events[2].code = SYN_REPORT;
+        if (write(fd, events, sizeof(events)) != sizeof(events)) {
+            perror(("Failed to write to " + path).c_str());
+        }
+    }
+
+    const std::string path;
+    int fd = -1;
+};
+
+static int64_t nanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t openFds(const pid_t pid)
+{
+    std::error_code error;
+    size_t count = 0;
+    for ([[maybe_unused]] const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator("/proc/" + std::to_string(pid) + "/fd", error)) {
+        count++;
+    }
+    return count;
+}
+
+static long residentKilobytes(const pid_t pid)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmRSS:")) {
+            return atol(line.c_str() + strlen("VmRSS:"));
+        }
+    }
+    return -1;
+}
+
+struct Harness
+{
+    bool start(const std::string &executable, const std::vector<std::string> &options)
+    {
+        char pattern[] = "/tmp/shortcut-satan-hotplug.XXXXXX";
+        if (!mkdtemp(pattern)) {
+            perror("Failed to create directory");
+            return false;
+        }
+        directory = pattern;
+
+        // Not next to the keyboards, or it would wake up the config watcher
+        const std::string configDirectory = directory + "/config";
+        const std::string configPath = configDirectory + "/shortcut-satan.conf";
+        std::filesystem::create_directory(configDirectory);
+        const std::string firedPath = directory + "/fired";
+        std::ofstream config(configPath);
+        config << "LEFTALT A: @fifo " << firedPath << " probe\n";
+        config << "LEFTMETA B: @fifo " << firedPath << " span\n";
+        config.close();
+
+        if (mkfifo(firedPath.c_str(), 0600) == -1) {
+            perror("Failed to create fifo");
+            return false;
+        }
+        firedFd = open(firedPath.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+        stable.emplace_back(std::make_unique<FakeKeyboard>(directory + "/event-stable0"));
+        stable.emplace_back(std::make_unique<FakeKeyboard>(directory + "/event-stable1"));
+
+        const std::string logPath = directory + "/log";
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        std::vector<const char*> argv = { executable.c_str(), "--stats", "-c", configPath.c_str(), "--fake-udev", directory.c_str() };
+        for (const std::string &option : options) {
+            argv.push_back(option.c_str());
+        }
+        argv.push_back(nullptr);
+        const int ret = posix_spawn(&daemonPid, executable.c_str(), &actions, nullptr, const_cast<char**>(argv.data()), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to start %s: %s\n", executable.c_str(), strerror(ret));
+            daemonPid = -1;
+            return false;
+        }
+
+        // Wait for it to be listening for uevents
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s/uevents", directory.c_str());
+        ueventFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        for (int i=0; i<s_timeoutMs; i++) {
+            if (connect(ueventFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // And for it to actually handle keys
+        if (probe() < 0) {
+            fprintf(stderr, "%s never started handling keys, see %s\n", executable.c_str(), logPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    ~Harness()
+    {
+        stop();
+        transient.clear();
+        stable.clear();
+        if (firedFd != -1) close(firedFd);
+        if (ueventFd != -1) close(ueventFd);
+        if (!directory.empty()) {
+            std::filesystem::remove_all(directory);
+        }
+    }
+
+    void stop()
+    {
+        if (daemonPid <= 0) {
+            return;
+        }
+        kill(daemonPid, SIGTERM);
+        int status = 0;
+        waitpid(daemonPid, &status, 0);
+        daemonPid = -1;
+
+        // Show what it thinks about it
+        std::ifstream log(directory + "/log");
+        std::string line;
+        while (std::getline(log, line)) {
+            if (line.starts_with("Woke up") || line.find(" -> ") != std::string::npos) {
+                printf("  daemon: %s\n", line.c_str());
+            }
+        }
+    }
+
+    void uevent(const std::string &action, const std::string &path)
+    {
+        const std::string message = action + " " + path;
+        // Blocks if it's falling behind, like the netlink socket would drop
+        if (send(ueventFd, message.data(), message.size(), 0) == -1) {
+            perror("Failed to send uevent");
+        }
+    }
+
+    // Returns how long it took until it fired, in nanoseconds, or -1 if it
+    // didn't fire
+    int64_t waitFor(const std::string &what, const int64_t since)
+    {
+        while (true) {
+            pollfd pfd = { firedFd, POLLIN, 0 };
+            const int ret = poll(&pfd, 1, s_timeoutMs);
+            if (ret <= 0) {
+                return -1;
+            }
+            char buffer[256];
+            const ssize_t size = read(firedFd, buffer, sizeof(buffer));
+            if (size <= 0) {
+                continue;
+            }
+            pending.append(buffer, size);
+            const size_t end = pending.find('\n');
+            if (end == std::string::npos) {
+                continue;
+            }
+            const std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if (line == what) {
+                return nanoseconds() - since;
+            }
+            fprintf(stderr, "Expected %s, got %s\n", what.c_str(), line.c_str());
+        }
+    }
+
+    int64_t probe()
+    {
+        FakeKeyboard &keyboard = *stable[1];
+        keyboard.key(KEY_LEFTALT, 1);
+        const int64_t pressed = nanoseconds();
+        keyboard.key(KEY_A, 1);
+        keyboard.key(KEY_A, 0);
+        keyboard.key(KEY_LEFTALT, 0);
+        return waitFor("probe", pressed);
+    }
+
+    void addTransient()
+    {
+        transient.emplace_back(std::make_unique<FakeKeyboard>(directory + "/event" + std::to_string(nextId++)));
+        uevent("add", transient.back()->path);
+    }
+
+    void removeTransient()
+    {
+        uevent("remove", transient.front()->path);
+        transient.pop_front();
+    }
+
+    // Asks the daemon over its control socket, empty if that failed
+    std::string control(const std::string &request)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s/shortcut-satan.sock", directory.c_str());
+        const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+            perror("Failed to connect to control socket");
+            if (fd != -1) close(fd);
+            return {};
+        }
+        std::string reply;
+        if (send(fd, request.data(), request.size(), 0) == -1) {
+            perror("Failed to send control request");
+        } else {
+            std::vector<char> buffer(64 * 1024);
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, s_timeoutMs) == 1) {
+                const ssize_t size = recv(fd, buffer.data(), buffer.size(), 0);
+                if (size > 0) {
+                    reply.assign(buffer.data(), size);
+                }
+            }
+        }
+        close(fd);
+        return reply;
+    }
+
+    // How many of the transient keyboards it doesn't have open, after giving
+    // it some time to catch up
+    size_t missingTransient()
+    {
+        size_t missing = transient.size();
+        for (int i=0; i<s_timeoutMs / 10; i++) {
+            // Lines are "id path devpath"
+            const std::string devices = control("devices");
+            missing = 0;
+            for (const std::unique_ptr<FakeKeyboard> &keyboard : transient) {
+                missing += devices.find(" " + keyboard->path + " ") == std::string::npos;
+            }
+            if (missing == 0) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return missing;
+    }
+
+    // Waits for it to close everything we removed
+    size_t settle(const size_t expectedFds)
+    {
+        size_t fds = openFds(daemonPid);
+        for (int i=0; i<s_timeoutMs / 10 && fds != expectedFds; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            fds = openFds(daemonPid);
+        }
+        return fds;
+    }
+
+    std::string directory;
+    pid_t daemonPid = -1;
+    int firedFd = -1;
+    int ueventFd = -1;
+    std::string pending;
+
+    std::vector<std::unique_ptr<FakeKeyboard>> stable;
+    std::deque<std::unique_ptr<FakeKeyboard>> transient;
+    int nextId = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    const std::string executable = argc > 1 ? argv[1] : "./shortcut-satan";
+    const std::vector<std::string> options(argv + std::min(argc, 2), argv + argc);
+    if (access(executable.c_str(), X_OK) != 0) {
+        fprintf(stderr, "Can't run %s, build it first\n", executable.c_str());
+        return 1;
+    }
+
+    // So we don't die if the daemon goes away while we're writing to it
+    signal(SIGPIPE, SIG_IGN);
+
+    Harness harness;
+    if (!harness.start(executable, options)) {
+        return 1;
+    }
+
+    static Histogram idle;
+    for (int i=0; i<100; i++) {
+        idle.record(harness.probe());
+    }
+
+    const size_t fdsBefore = openFds(harness.daemonPid);
+    const long residentBefore = residentKilobytes(harness.daemonPid);
+    printf("%d add/remove cycles, up to %lu fake keyboards at a time\n", s_cycles, s_maxTransient);
+
+    std::mt19937 random(1337);
+    static Histogram storm;
+    int spansFired = 0;
+    int spans = 0;
+    int probesMissed = 0;
+    long residentHalfway = 0;
+
+    const int64_t start = nanoseconds();
+    for (int cycle=0; cycle<s_cycles; cycle++) {
+        if (cycle % s_spanEvery == 0) {
+            // Held down across the next s_spanEvery cycles
+            harness.stable[0]->key(KEY_LEFTMETA, 1);
+        }
+
+        harness.addTransient();
+        FakeKeyboard &keyboard = *harness.transient[random() % harness.transient.size()];
+        const uint16_t code = s_randomKeys[random() % std::size(s_randomKeys)];
+        keyboard.key(code, 1);
+        // Sometimes it's removed while the key is held down
+        if (random() % 4 != 0) {
+            keyboard.key(code, 0);
+        }
+        if (harness.transient.size() > s_maxTransient) {
+            harness.removeTransient();
+        }
+
+        if (cycle % s_probeEvery == 0) {
+            const int64_t latency = harness.probe();
+            if (latency < 0) {
+                probesMissed++;
+            } else {
+                storm.record(latency);
+            }
+        }
+
+        if (cycle % s_spanEvery == s_spanEvery - 1) {
+            FakeKeyboard &other = *harness.stable[1];
+            const int64_t pressed = nanoseconds();
+            other.key(KEY_B, 1);
+            other.key(KEY_B, 0);
+            harness.stable[0]->key(KEY_LEFTMETA, 0);
+            spans++;
+            spansFired += harness.waitFor("span", pressed) >= 0;
+        }
+
+        if (cycle == s_cycles / 2) {
+            residentHalfway = residentKilobytes(harness.daemonPid);
+        }
+    }
+    const double seconds = (nanoseconds() - start) / 1e9;
+
+    // A burst with nothing else going on, so they're likely to all be read
+    // in the same wakeup. Every one of them, and the ones still there from
+    // the storm, should end up open.
+    for (size_t i=0; i<s_burst; i++) {
+        harness.addTransient();
+    }
+    const size_t transientCount = harness.transient.size();
+    const size_t notOpened = harness.missingTransient();
+
+    while (!harness.transient.empty()) {
+        harness.removeTransient();
+    }
+    const size_t fdsAfter = harness.settle(fdsBefore);
+    const long residentAfter = residentKilobytes(harness.daemonPid);
+
+    printf("%.0f cycles/s\n", s_cycles / seconds);
+    idle.print("idle probe");
+    storm.print("storm probe");
+    printf("probes missed: %d, held across storm: %d/%d fired\n", probesMissed, spansFired, spans);
+    printf("added keyboards not opened: %lu of %lu\n", notOpened, transientCount);
+    printf("fds: %lu before, %lu after; resident: %ld kB before, %ld kB halfway, %ld kB after\n",
+            fdsBefore, fdsAfter, residentBefore, residentHalfway, residentAfter);
+
+    harness.stop();
+
+    if (fdsAfter != fdsBefore || spansFired != spans || probesMissed > 0 || notOpened > 0) {
+        puts("FAILED");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Compares the old fork() + close() loop + system() launch path with
+// posix_spawn() through sh and posix_spawn() of the resolved executable, in a
+// process that looks a bit like a daemon that has been running for a while:
+// lots of resident memory and a high fd limit.
+
+static bool s_verbose = false;
+static bool s_dryRun = false;
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include "command.h"
+
+extern "C" {
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+}
+
+static constexpr int s_iterations = 50;
+static constexpr size_t s_residentMegabytes = 256;
+
+// What launch() used to do
+static pid_t legacyLaunch(const std::string &command)
+{
+    const int pid = fork();
+    switch(pid) {
+    case 0: {
+        int maxfd = FD_SETSIZE;
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+            maxfd = rl.rlim_cur;
+        }
+        for (int fd = 3; fd < maxfd; ++fd) {
+            close(fd);
+        }
+
+        signal(SIGCHLD, SIG_DFL);
+        std::system(command.c_str());
+        exit(0);
+    }
+    case -1:
+        perror(" ! Error forking");
+        return -1;
+    default:
+        return pid;
+    }
+}
+
+template<typename Func>
+static void bench(const char *name, const std::string &command, Func &&launchFunc)
+{
+    std::chrono::nanoseconds blocked(0);
+    std::chrono::nanoseconds total(0);
+    for (int i=0; i<s_iterations; i++) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const pid_t pid = launchFunc(command);
+        const std::chrono::steady_clock::time_point launched = std::chrono::steady_clock::now();
+        if (pid <= 0) {
+            puts("Failed to launch");
+            exit(1);
+        }
+        waitpid(pid, nullptr, 0);
+        const std::chrono::steady_clock::time_point exited = std::chrono::steady_clock::now();
+
+        blocked += launched - start;
+        total += exited - start;
+    }
+    printf("%-12s   %14.1f   %16.1f\n", name,
+            blocked.count() / 1000. / s_iterations,
+            total.count() / 1000. / s_iterations);
+    fflush(stdout);
+}
+
+int main()
+{
+    // systemd likes to raise the fd limit a lot
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Make fork() have something to copy
+    std::vector<char> resident(s_residentMegabytes * 1024 * 1024);
+    for (size_t i=0; i<resident.size(); i += 4096) {
+        resident[i] = 1;
+    }
+
+    printf("RLIMIT_NOFILE: %lu, resident: %lu MiB, %d launches of 'true'\n", rl.rlim_cur, s_residentMegabytes, s_iterations);
+    puts("path           in launch (us)   until exited (us)");
+    // The forked children would flush our buffer again on exit()
+    fflush(stdout);
+    bench("fork+system", "true", legacyLaunch);
+    bench("spawn sh", "true", [](const std::string &command) {
+        // What the posix_spawn() path does with commands that need a shell
+        char *const argv[] = { const_cast<char*>("sh"), const_cast<char*>("-c"), const_cast<char*>(command.c_str()), nullptr };
+        return spawn("/bin/sh", argv);
+    });
+    const Command direct = Command::parse("true");
+    if (direct.type != Command::Exec) {
+        puts("Failed to resolve 'true' in PATH");
+        return 1;
+    }
+    bench("spawn direct", "true", [&direct](const std::string &) { return launch(direct); });
+    return 0;
+}
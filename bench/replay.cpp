@@ -0,0 +1,203 @@
+// Replays a trace of key events through the same code the daemon uses for
+// handling them, as fast as possible, and reports how many events and
+// matches per second we manage, both in one thread and with --pipeline.
+// Nothing is launched.
+//
+// It also counts the allocations while replaying and fails if there are
+// any, nothing between reading an event and launching should allocate.
+//
+// Usage: replay [config trace]
+//
+// Without arguments it generates a config and a trace of someone typing on two
+// keyboards and occasionally pressing a shortcut, so it runs anywhere. A real
+// trace can be recorded with shortcut-satan --record <trace>.
+
+static bool s_verbose = false;
+static bool s_veryVerbose = false;
+static bool s_dryRun = true;
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <atomic>
+#include <new>
+
+#include "keyboard.h"
+#include "config.h"
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+}
+
+// Counts every allocation, from any thread
+static std::atomic<uint64_t> s_allocations = 0;
+
+void *operator new(size_t size)
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *ret = malloc(size ? size : 1);
+    if (!ret) {
+        throw std::bad_alloc();
+    }
+    return ret;
+}
+
+void operator delete(void *pointer) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+
+static constexpr int s_rounds = 50;
+static constexpr size_t s_generatedPresses = 50000;
+
+static const uint16_t s_modifierCodes[] = { KEY_LEFTMETA, KEY_LEFTCTRL, KEY_LEFTALT, KEY_LEFTSHIFT };
+
+static void generateConfig(const std::string &path)
+{
+    std::ofstream file(path);
+    // Two modifiers + a letter, the kind of thing people have
+    for (const char *letter : { "A", "B", "C", "D", "E", "F", "G", "H", "J", "K", "L", "M", "N" }) {
+        file << "LEFTMETA " << letter << ": true\n";
+        file << "LEFTMETA LEFTSHIFT " << letter << ": true\n";
+        file << "LEFTCTRL LEFTALT " << letter << ": true\n";
+    }
+    file << "MUTE: true\nVOLUMEUP: true\nVOLUMEDOWN: true\n";
+}
+
+static void addEvent(std::vector<input_event> *events, const uint16_t type, const uint16_t code, const int32_t value, const uint64_t time)
+{
+    input_event event = {};
+    event.input_event_sec = time / 1000000000UL;
+    event.input_event_usec = (time % 1000000000UL) / 1000;
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    events->push_back(event);
+}
+
+// What a keyboard sends for a key press or release
+static void addKey(std::vector<input_event> *events, const uint16_t code, const int32_t value, const uint64_t time)
+{
+    addEvent(events, EV_MSC, MSC_SCAN, code, time);
+    addEvent(events, EV_KEY, code, value, time);
+    addEvent(events, EV_SYN, SYN_REPORT, 0, time);
+}
+
+static bool generateTrace(const std::string &path)
+{
+    TraceRecorder recorder(nullptr, path);
+    if (!recorder.isValid()) {
+        return false;
+    }
+
+    std::mt19937 random(1337);
+    std::uniform_int_distribution<int> letter(KEY_Q, KEY_P);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    uint64_t time = 0;
+    std::vector<input_event> events;
+    for (size_t i=0; i<s_generatedPresses; i++) {
+        const uint32_t device = percent(random) < 80 ? 0 : 1;
+        const bool shortcut = percent(random) < 5;
+        const uint16_t modifier = s_modifierCodes[percent(random) % std::size(s_modifierCodes)];
+        const uint16_t code = shortcut ? KEY_A + percent(random) % 10 : letter(random);
+
+        events.clear();
+        if (shortcut) addKey(&events, modifier, 1, time += 50000000);
+        addKey(&events, code, 1, time += 80000000);
+        addKey(&events, code, 2, time += 1000000);
+        addKey(&events, code, 0, time += 40000000);
+        if (shortcut) addKey(&events, modifier, 0, time += 30000000);
+        recorder.record(device, events.data(), events.size());
+    }
+    return true;
+}
+
+// Returns false if it failed
+static bool replay(TraceReplayer *replayer, std::vector<File> *keyboards, ShortcutTable *shortcuts)
+{
+    for (int round=0; round<s_rounds; round++) {
+        replayer->rewind();
+        while (!replayer->atEnd()) {
+            const uint32_t device = replayer->nextDevice();
+            if (device >= keyboards->size()) {
+                keyboards->resize(device + 1);
+            }
+            (*keyboards)[device].id = device;
+            if (!handleKey(&(*keyboards)[device], shortcuts, replayer)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string configPath;
+    std::string tracePath;
+    if (argc == 3) {
+        configPath = argv[1];
+        tracePath = argv[2];
+    } else if (argc == 1) {
+        configPath = "/tmp/shortcut-satan-replay.conf";
+        tracePath = "/tmp/shortcut-satan-replay.trace";
+        generateConfig(configPath);
+        if (!generateTrace(tracePath)) {
+            return 1;
+        }
+    } else {
+        printf("Usage: %s [config trace]\n", argv[0]);
+        return EINVAL;
+    }
+
+    std::unique_ptr<ShortcutTable> shortcuts = loadShortcuts(configPath, false);
+    if (!shortcuts) {
+        printf("Failed to load %s\n", configPath.c_str());
+        return 1;
+    }
+
+    TraceReplayer replayer(tracePath);
+    if (!replayer.isValid()) {
+        return 1;
+    }
+
+    // So adding them doesn't count as allocating while replaying
+    std::vector<File> keyboards;
+    keyboards.reserve(64);
+    printf("%lu shortcuts, %lu events, %d rounds\n", shortcuts->shortcuts.size(), replayer.size(), s_rounds);
+    printf("%-14s %14s %12s %14s %12s\n", "", "events/s", "matches/s", "ns per event", "allocations");
+    bool allocated = false;
+    for (const bool pipelined : { false, true }) {
+        const uint64_t matchesBefore = s_latency.match.count.load();
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (pipelined) {
+            s_pipeline.start(shortcuts.get(), false);
+        }
+        const uint64_t allocationsBefore = s_allocations.load();
+        if (!replay(&replayer, &keyboards, shortcuts.get())) {
+            printf("Failed to replay\n");
+            return 1;
+        }
+        // Includes waiting for the other threads to finish
+        s_pipeline.stop();
+        const uint64_t allocations = s_allocations.load() - allocationsBefore;
+        allocated |= allocations > 0;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const double events = double(replayer.size()) * s_rounds;
+        const double matches = s_latency.match.count.load() - matchesBefore;
+        printf("%-14s %14.0f %12.0f %14.1f %12lu\n", pipelined ? "pipeline" : "single thread",
+                events / seconds, matches / seconds, seconds * 1e9 / events, allocations);
+    }
+    if (argc == 1) {
+        unlink(configPath.c_str());
+        unlink(tracePath.c_str());
+    }
+    if (allocated) {
+        puts("FAILED: allocated while handling events");
+        return 1;
+    }
+    return 0;
+}
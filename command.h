@@ -0,0 +1,325 @@
+#pragma once
+
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+extern "C" {
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+}
+
+// The command for a shortcut, figured out when the config is loaded.
+//
+// Most commands are just a program with some arguments, so for those we
+// split it up and look up the program in PATH once, and exec it directly
+// when the shortcut is activated. Only if it actually needs a shell (pipes,
+// variables, quoting etc.) we go through sh.
+//
+// There's also some builtins for the really simple stuff, that we just do
+// ourselves without starting any process:
+//   @write <path> <value>      writes value to path, e. g. something in /sys
+//   @fifo <path> <text>        writes a line to a fifo, if someone is reading
+//   @signal <pidfile> <signal> sends a signal to the process in the pidfile
+struct Command
+{
+    enum Type {
+        Invalid,
+        Shell,
+        Exec,
+        Write,
+        Fifo,
+        Signal
+    };
+
+    Command() = default;
+
+    Command(const Command &other) : type(other.type), text(other.text), path(other.path), args(other.args), data(other.data), signal(other.signal) { updateArgv(); }
+    Command(Command &&other) : type(other.type), text(std::move(other.text)), path(std::move(other.path)), args(std::move(other.args)), data(std::move(other.data)), signal(other.signal) { updateArgv(); }
+
+    Command &operator=(const Command &other)
+    {
+        type = other.type;
+        text = other.text;
+        path = other.path;
+        args = other.args;
+        data = other.data;
+        signal = other.signal;
+        updateArgv();
+        return *this;
+    }
+
+    Command &operator=(Command &&other)
+    {
+        type = other.type;
+        text = std::move(other.text);
+        path = std::move(other.path);
+        args = std::move(other.args);
+        data = std::move(other.data);
+        signal = other.signal;
+        updateArgv();
+        return *this;
+    }
+
+    static Command parse(const std::string &text)
+    {
+        Command command;
+        command.text = text;
+        if (text.empty()) {
+            return command;
+        }
+
+        if (text[0] == '@') {
+            command.parseBuiltin();
+            return command;
+        }
+
+        if (!needsShell(text)) {
+            std::istringstream stream(text);
+            std::string arg;
+            while (std::getline(stream, arg, ' ')) {
+                if (!arg.empty()) {
+                    command.args.push_back(arg);
+                }
+            }
+
+            command.path = findExecutable(command.args[0]);
+            if (!command.path.empty()) {
+                command.type = Exec;
+                command.updateArgv();
+                return command;
+            }
+            // Let the shell figure it out (and complain)
+            if (s_verbose) logPrint("%s not found in PATH\n", command.args[0]);
+            command.args.clear();
+        }
+
+        command.type = Shell;
+        command.path = "/bin/sh";
+        command.args = { "sh", "-c", text };
+        command.updateArgv();
+        return command;
+    }
+
+    bool isValid() const { return type != Invalid; }
+
+    // If we need to start a process for it, or if it's one of the builtins
+    bool isProcess() const { return type == Shell || type == Exec; }
+
+    const char *typeName() const
+    {
+        switch(type) {
+        case Shell: return "shell";
+        case Exec: return "exec";
+        case Write: return "write";
+        case Fifo: return "fifo";
+        case Signal: return "signal";
+        case Invalid:
+        default:
+            return "invalid";
+        }
+    }
+
+    Type type = Invalid;
+
+    // What's in the config
+    std::string text;
+
+    // What we actually run
+    std::string path;
+    std::vector<std::string> args;
+
+    // Points into args, null terminated, ready to pass to exec
+    std::vector<char*> argv;
+
+    // For the builtins, what to write or which signal to send
+    std::string data;
+    int signal = 0;
+
+    // Returns false if it failed
+    bool runBuiltin() const
+    {
+        switch(type) {
+        case Write:
+            return writeTo(O_TRUNC);
+        case Fifo:
+            return writeTo(0);
+        case Signal:
+            return sendSignal();
+        default:
+            return false;
+        }
+    }
+
+private:
+    void parseBuiltin()
+    {
+        std::istringstream stream(text);
+        std::string name;
+        stream >> name >> path;
+        std::getline(stream >> std::ws, data);
+        if (path.empty() || data.empty()) {
+            logPrint("Missing arguments for builtin: %s\n", text);
+            return;
+        }
+        path = resolvePath(path);
+        if (path.empty()) {
+            logPrint("Invalid path for builtin: %s\n", text);
+            return;
+        }
+
+        if (name == "@write") {
+            type = Write;
+        } else if (name == "@fifo") {
+            // Make it a proper line for whoever is reading
+            data += '\n';
+            type = Fifo;
+        } else if (name == "@signal") {
+            signal = signalNumber(data);
+            if (signal <= 0) {
+                logPrint("Invalid signal: %s\n", data);
+                return;
+            }
+            type = Signal;
+        } else {
+            logPrint("Unknown builtin: %s\n", name);
+        }
+    }
+
+    static int signalNumber(std::string name)
+    {
+        if (std::isdigit(name[0])) {
+            return atoi(name.c_str());
+        }
+        name = std_sux::uppercase(name);
+        if (name.starts_with("SIG")) {
+            name = name.substr(3);
+        }
+        static const std::pair<const char*, int> signals[] = {
+            {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+            {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+            {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"WINCH", SIGWINCH}, {"ALRM", SIGALRM},
+        };
+        for (const std::pair<const char*, int> &signal : signals) {
+            if (name == signal.first) {
+                return signal.second;
+            }
+        }
+        return -1;
+    }
+
+    bool writeTo(const int flags) const
+    {
+        // Non blocking, a fifo without a reader should fail instead of hang
+        const int fd = open(path.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC | flags);
+        if (fd == -1) {
+            logError("Failed to open %s: %s\n", path, strerrordesc_np(errno));
+            return false;
+        }
+        const ssize_t ret = write(fd, data.data(), data.size());
+        if (ret != ssize_t(data.size())) {
+            logError("Failed to write to %s: %s\n", path, strerrordesc_np(errno));
+        }
+        close(fd);
+        return ret == ssize_t(data.size());
+    }
+
+    bool sendSignal() const
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            logError("Failed to open %s: %s\n", path, strerrordesc_np(errno));
+            return false;
+        }
+        char buffer[32] = {};
+        const ssize_t ret = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+
+        const pid_t pid = ret > 0 ? atoi(buffer) : 0;
+        if (pid <= 0) {
+            logPrint("No valid pid in %s\n", path);
+            return false;
+        }
+        if (kill(pid, signal) == -1) {
+            logError("Failed to send signal: %s\n", strerrordesc_np(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void updateArgv()
+    {
+        argv.clear();
+        for (std::string &arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+    }
+
+    static bool needsShell(const std::string &text)
+    {
+        // Anything sh would treat specially, erring on the side of the shell
+        if (text.find_first_of("|&;<>()$`\\\"'*?[]{}#~!\t\n") != std::string::npos) {
+            return true;
+        }
+
+        // Variable assignment, like FOO=bar command
+        const size_t firstSpace = text.find(' ');
+        if (text.substr(0, firstSpace).find('=') != std::string::npos) {
+            return true;
+        }
+
+        return false;
+    }
+
+    static std::string findExecutable(const std::string &name)
+    {
+        if (name.find('/') != std::string::npos) {
+            return access(name.c_str(), X_OK) == 0 ? name : "";
+        }
+
+        const char *rawPath = getenv("PATH");
+        std::istringstream stream(rawPath ? rawPath : "/usr/local/bin:/usr/bin:/bin");
+        std::string directory;
+        while (std::getline(stream, directory, ':')) {
+            if (directory.empty()) {
+                directory = ".";
+            }
+            const std::string candidate = directory + "/" + name;
+            struct stat info;
+            if (stat(candidate.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+                continue;
+            }
+            if (access(candidate.c_str(), X_OK) == 0) {
+                return candidate;
+            }
+        }
+        return {};
+    }
+};
+
+// Returns the pid, 0 if it didn't need a process, or -1 if it failed
+static pid_t launch(const Command &command)
+{
+    if (s_verbose) logPrint(" -> Launching '%s' (%s)\n", command.text, command.typeName());
+
+    if (!command.isValid()) {
+        return -1;
+    }
+
+    if (!command.isProcess()) {
+        if (s_dryRun) {
+            return 0;
+        }
+        return command.runBuiltin() ? 0 : -1;
+    }
+
+    return spawn(command.path.c_str(), command.argv.data());
+}
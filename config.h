@@ -0,0 +1,148 @@
+#pragma once
+
+#include "shortcuts.h"
+#include "keys.h"
+#include "utils.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+
+[[maybe_unused]] static std::string getConfigPath()
+{
+    std::string path;
+
+    char *rawPath = getenv("XDG_CONFIG_HOME");
+    if (rawPath) {
+        path = std::string(rawPath);
+    }
+    if (path.empty()) {
+        rawPath = getenv("HOME");
+        if (rawPath) {
+            path = getenv("HOME");
+            path += "/.config";
+        }
+    } else if (path.find(':') != std::string::npos) {
+        std::istringstream stream(path);
+        std::string testPath;
+        while (std::getline(stream, testPath, ':')) {
+            testPath = resolvePath(testPath);
+            if (!std::filesystem::exists(testPath)) {
+                continue;
+            }
+            if (!std::filesystem::is_directory(testPath)) {
+                continue;
+            }
+
+            path = testPath;
+            break;
+        }
+    }
+    path += "/shortcut-satan.conf";
+    return resolvePath(path);
+}
+
+static Shortcut parseShortcut(const std::string &line)
+{
+    if (line.empty()) {
+        return {};
+    }
+    if (line[0] == '#') {
+        return {};
+    }
+    std::string name;
+    std::string value;
+
+    size_t splitPos = line.find(':');
+    if (splitPos == std::string::npos) {
+        logPrint("Invalid line %s\n", line);
+        return {};
+    }
+
+    Shortcut shortcut;
+    shortcut.command = Command::parse(std_sux::trim(line.substr(splitPos + 1)));
+    if (!shortcut.command.isValid()) {
+        logPrint("Missing command: %s\n", line);
+        return {};
+    }
+
+    const std::string keys = std_sux::trim(line.substr(0, splitPos));
+    if (keys.empty()) {
+        logPrint("Missing keys: %s\n", line);
+        return {};
+    }
+
+    std::istringstream stream(keys);
+    std::string keyString;
+    while (std::getline(stream, keyString, ' ')) {
+        const int keyCode = getKeyCode(std_sux::trim(keyString));
+        if (keyCode == -1) {
+            logPrint("Invalid key %s\n", keyString);
+            return {};
+        }
+        shortcut.keys.push_back(keyCode);
+    }
+    return shortcut;
+}
+
+// If ok is set it's set to false if there's anything wrong in the config
+static std::vector<Shortcut> parseConfig(const std::string &path, bool *ok = nullptr)
+{
+    if (ok) {
+        *ok = false;
+    }
+
+    if (!std::filesystem::exists(path)) {
+        logPrint("%s does not exist\n", path);
+        return {};
+    }
+
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        perror(("Failed to open config file" + path).c_str());
+        return {};
+    }
+
+    std::vector<Shortcut> ret;
+    std::string line;
+    bool allValid = true;
+    while (std::getline(file, line)) {
+        line = std_sux::trim(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        Shortcut shortcut = parseShortcut(line);
+        if (!shortcut.isValid()) {
+            allValid = false;
+            continue;
+        }
+        ret.push_back(shortcut);
+    }
+
+    if (ok) {
+        *ok = allValid && !ret.empty();
+    }
+    return ret;
+}
+
+// If strict is set nothing is returned if there's anything wrong with the
+// config, so we can keep running with what we have.
+static std::unique_ptr<ShortcutTable> loadShortcuts(const std::string &path, const bool strict)
+{
+    bool ok = false;
+    std::vector<Shortcut> parsed = parseConfig(path, &ok);
+    if (parsed.empty() || (strict && !ok)) {
+        return nullptr;
+    }
+
+    for (const Shortcut &s : parsed) {
+        for (const uint16_t k : s.keys) {
+            if (s_verbose) logPrint("Keycode: %d\n", k);
+        }
+        if (s_verbose) logPrint("Command: %s (%s %s)\n", s.command.text, s.command.typeName(), s.command.path);
+    }
+    return std::make_unique<ShortcutTable>(std::move(parsed));
+}
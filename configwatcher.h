@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+
+extern "C" {
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+}
+
+// Tells us when the config file has changed.
+//
+// Editors either write the file in place or write a new file and rename it
+// over the old one, so we watch both the file itself (which also follows
+// symlinks into e. g. a dotfiles repo) and the directory it's in.
+struct ConfigWatcher
+{
+    ConfigWatcher(const std::string &path) :
+        m_filename(std::filesystem::path(path).filename()),
+        m_path(path)
+    {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1) {
+            perror("Failed to create inotify instance");
+            return;
+        }
+
+        const std::string directory = std::filesystem::path(path).parent_path();
+        m_directoryWatch = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (m_directoryWatch == -1) {
+            perror(("Failed to watch " + directory).c_str());
+        }
+        watchFile();
+    }
+
+    ~ConfigWatcher()
+    {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    ConfigWatcher(const ConfigWatcher &) = delete;
+    ConfigWatcher &operator=(const ConfigWatcher &) = delete;
+
+    bool isValid() const { return fd != -1; }
+
+    // Reads all pending events, returns true if any of them were about our
+    // config file.
+    bool hasChanged()
+    {
+        bool changed = false;
+
+        alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+        while (true) {
+            const ssize_t ret = read(fd, buffer, sizeof(buffer));
+            if (ret <= 0) {
+                if (ret == -1 && errno != EAGAIN) {
+                    perror("Failed to read inotify events");
+                }
+                break;
+            }
+
+            for (char *ptr = buffer; ptr < buffer + ret; ptr += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(ptr)->len) {
+                const inotify_event *event = reinterpret_cast<inotify_event*>(ptr);
+                if (event->wd == m_fileWatch) {
+                    if (event->mask & IN_MOVE_SELF) {
+                        // Renamed away, e. g. to a backup, so not ours anymore
+                        inotify_rm_watch(fd, m_fileWatch);
+                        m_fileWatch = -1;
+                    } else if (event->mask & IN_IGNORED) {
+                        // Deleted or replaced
+                        m_fileWatch = -1;
+                    }
+                    changed = true;
+                    continue;
+                }
+                if (event->wd == m_directoryWatch && event->len > 0 && m_filename == event->name) {
+                    changed = true;
+                }
+            }
+        }
+
+        // If it was replaced we need to watch the new one
+        if (changed) {
+            watchFile();
+        }
+
+        return changed;
+    }
+
+    int fd = -1;
+
+private:
+    void watchFile()
+    {
+        if (m_fileWatch != -1) {
+            return;
+        }
+        m_fileWatch = inotify_add_watch(fd, m_path.c_str(), IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (m_fileWatch == -1 && errno != ENOENT) {
+            perror(("Failed to watch " + m_path).c_str());
+        }
+    }
+
+    const std::string m_filename;
+    const std::string m_path;
+
+    int m_directoryWatch = -1;
+    int m_fileWatch = -1;
+};
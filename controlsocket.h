@@ -0,0 +1,265 @@
+#pragma once
+
+#include "eventloop.h"
+#include "shortcuts.h"
+#include "keys.h"
+#include "log.h"
+
+#include <charconv>
+#include <string>
+#include <vector>
+#include <sstream>
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+}
+
+// Lets scripts ask a running daemon what it's doing, and poke it, instead of
+// restarting it (which means enumerating and opening everything again).
+//
+// It's a SOCK_SEQPACKET socket, so every request is one message with a
+// command like "devices" or "disable 3", and gets exactly one message back.
+// Nothing here blocks, a client that doesn't read its replies just doesn't
+// get them. Only the user we're running as can connect.
+struct ControlSocket
+{
+    static constexpr size_t MaxClients = 8;
+    static constexpr size_t MaxRequest = 4096;
+
+    explicit ControlSocket(const std::string &path) : m_path(path)
+    {
+        sockaddr_un address = {};
+        if (!makeAddress(path, &address)) {
+            return;
+        }
+
+        fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("Failed to create control socket");
+            return;
+        }
+
+        // We have the lock, so if it's there it's left over from a crash
+        unlink(path.c_str());
+
+        // Not accessible by anyone else, not even for a moment
+        const mode_t oldMask = umask(077);
+        const int ret = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        umask(oldMask);
+        if (ret == -1 || listen(fd, MaxClients) == -1) {
+            perror(("Failed to listen on " + path).c_str());
+            ::close(fd);
+            fd = -1;
+            return;
+        }
+        if (s_verbose) logPrint("Listening on %s\n", path);
+    }
+
+    ~ControlSocket()
+    {
+        for (const int client : m_clients) {
+            ::close(client);
+        }
+        if (fd != -1) {
+            ::close(fd);
+            unlink(m_path.c_str());
+        }
+    }
+
+    ControlSocket(const ControlSocket &) = delete;
+    ControlSocket &operator=(const ControlSocket &) = delete;
+
+    bool isValid() const { return fd != -1; }
+
+    bool isClient(const int clientFd) const
+    {
+        for (const int client : m_clients) {
+            if (client == clientFd) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Accepts new clients and answers whatever they've sent, handler gets the
+    // request and returns the reply.
+    template<typename Func>
+    void update(EventLoop *eventLoop, Func &&handler)
+    {
+        acceptClients(eventLoop);
+
+        char buffer[MaxRequest];
+        for (size_t i=0; i<m_clients.size();) {
+            const int client = m_clients[i];
+            const ssize_t length = ::recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (length == -1 && (errno == EAGAIN || errno == EINTR)) {
+                i++;
+                continue;
+            }
+            if (length <= 0) {
+                // Gone
+                eventLoop->remove(client);
+                ::close(client);
+                m_clients.erase(m_clients.begin() + i);
+                continue;
+            }
+
+            std::string request(buffer, length);
+            while (!request.empty() && (request.back() == '\n' || request.back() == ' ')) {
+                request.pop_back();
+            }
+            if (s_verbose) logPrint("Control request: %s\n", request);
+
+            const std::string reply = handler(request);
+            if (::send(client, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+                perror("Failed to send control reply");
+            }
+            // Keep going, it might have sent more than one
+        }
+    }
+
+    // For --control, sends one request to a running daemon and prints the
+    // reply. Returns the exit code.
+    static int sendRequest(const std::string &path, const std::string &request)
+    {
+        sockaddr_un address = {};
+        if (!makeAddress(path, &address)) {
+            return EINVAL;
+        }
+        const int client = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (client == -1) {
+            perror("Failed to create socket");
+            return EIO;
+        }
+        if (connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+            perror(("Failed to connect to " + path).c_str());
+            ::close(client);
+            return ECONNREFUSED;
+        }
+
+        // Don't hang forever if it's stuck
+        timeval timeout = {};
+        timeout.tv_sec = 5;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        if (::send(client, request.data(), request.size(), MSG_NOSIGNAL) == -1) {
+            perror("Failed to send request");
+            ::close(client);
+            return EIO;
+        }
+
+        std::vector<char> reply(1024 * 1024);
+        const ssize_t length = recv(client, reply.data(), reply.size(), 0);
+        ::close(client);
+        if (length == -1) {
+            perror("Failed to get reply");
+            return EIO;
+        }
+        fwrite(reply.data(), 1, length, stdout);
+
+        const std::string_view replyText(reply.data(), length);
+        return replyText.starts_with("Error:") ? EINVAL : 0;
+    }
+
+    int fd = -1;
+
+private:
+    static bool makeAddress(const std::string &path, sockaddr_un *address)
+    {
+        address->sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address->sun_path)) {
+            fprintf(stderr, "Control socket path too long: %s\n", path.c_str());
+            return false;
+        }
+        memcpy(address->sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    void acceptClients(EventLoop *eventLoop)
+    {
+        while (true) {
+            const int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client == -1) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    perror("Failed to accept control connection");
+                }
+                return;
+            }
+
+            // The socket is only accessible by us, but root can connect to
+            // anything, so check anyway before letting it launch things.
+            ucred credentials = {};
+            socklen_t length = sizeof(credentials);
+            if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1 || (credentials.uid != geteuid() && credentials.uid != 0)) {
+                if (s_verbose) logPrint("Rejected control connection from uid %u\n", credentials.uid);
+                ::close(client);
+                continue;
+            }
+            if (m_clients.size() >= MaxClients) {
+                if (s_verbose) logPrint("Too many control connections\n");
+                ::close(client);
+                continue;
+            }
+            if (!eventLoop->add(client)) {
+                ::close(client);
+                continue;
+            }
+            m_clients.push_back(client);
+        }
+    }
+
+    std::string m_path;
+    std::vector<int> m_clients;
+};
+
+// The keys like in the config, e. g. "LEFTALT A"
+static std::string shortcutKeys(const Shortcut &shortcut)
+{
+    std::string ret;
+    for (const uint16_t code : shortcut.keys) {
+        if (!ret.empty()) {
+            ret += ' ';
+        }
+        ret += getKeyName(code);
+    }
+    return ret;
+}
+
+// Finds shortcuts by their number in the list from "shortcuts", or by the
+// keys or the command like in the config.
+static std::vector<size_t> findShortcuts(const ShortcutTable &table, const std::string &name)
+{
+    std::vector<size_t> ret;
+    if (!name.empty() && std::all_of(name.begin(), name.end(), [](const char c) { return c >= '0' && c <= '9'; })) {
+        // Doesn't throw if it's too big, that just doesn't match anything
+        size_t index = 0;
+        const std::from_chars_result result = std::from_chars(name.data(), name.data() + name.size(), index);
+        if (result.ec == std::errc() && index < table.shortcuts.size()) {
+            ret.push_back(index);
+        }
+        return ret;
+    }
+    std::vector<uint16_t> keys;
+    std::istringstream stream(name);
+    std::string keyName;
+    while (stream >> keyName) {
+        const int code = getKeyCode(keyName);
+        if (code == -1) {
+            keys.clear();
+            break;
+        }
+        keys.push_back(code);
+    }
+    for (size_t i=0; i<table.shortcuts.size(); i++) {
+        if (table.shortcuts[i].command.text == name || (!keys.empty() && table.shortcuts[i].keys == keys)) {
+            ret.push_back(i);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "keyboard.h"
+#include "eventloop.h"
+#include "shortcuts.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+extern "C" {
+#include <sys/stat.h>
+#include <sys/types.h>
+}
+
+// Keyboards get a new id every time they're opened, used in traces
+static uint32_t s_nextKeyboardId = 0;
+
+// All the keyboards we have open.
+//
+// Every keyboard gets a slot that it keeps until it's removed, and slots are
+// reused afterwards. The slots are in a deque, which never moves what's
+// already in it when growing, so a File* stays valid until that keyboard is
+// removed. They can be looked up by fd (for events), devpath (for udev) and
+// device number, all without searching.
+struct DeviceRegistry
+{
+    static constexpr uint32_t NoSlot = 0xffffffff;
+
+    DeviceRegistry() = default;
+    DeviceRegistry(const DeviceRegistry &) = delete;
+    DeviceRegistry &operator=(const DeviceRegistry &) = delete;
+
+    // Takes over the file, devpath and devnum should be set
+    File *add(File &&file)
+    {
+        uint32_t slot;
+        if (!m_freeSlots.empty()) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else {
+            slot = m_slots.size();
+            m_slots.emplace_back();
+        }
+        m_slots[slot] = std::move(file);
+        File *keyboard = &m_slots[slot];
+
+        if (size_t(keyboard->fd) >= m_fdSlots.size()) {
+            m_fdSlots.resize(keyboard->fd + 1, NoSlot);
+        }
+        m_fdSlots[keyboard->fd] = slot;
+        if (!keyboard->devpath.empty()) {
+            m_devpathSlots[keyboard->devpath] = slot;
+        }
+        if (keyboard->devnum != 0) {
+            m_devnumSlots[keyboard->devnum] = slot;
+        }
+        m_count++;
+        return keyboard;
+    }
+
+    // Gives it back, still open, and the slot can be reused
+    File take(File *keyboard)
+    {
+        const uint32_t slot = m_fdSlots[keyboard->fd];
+        m_fdSlots[keyboard->fd] = NoSlot;
+        m_devpathSlots.erase(keyboard->devpath);
+        m_devnumSlots.erase(keyboard->devnum);
+        File file = std::move(m_slots[slot]);
+        m_slots[slot] = File();
+        m_freeSlots.push_back(slot);
+        m_count--;
+        return file;
+    }
+
+    File *findFd(const int fd)
+    {
+        if (fd < 0 || size_t(fd) >= m_fdSlots.size() || m_fdSlots[fd] == NoSlot) {
+            return nullptr;
+        }
+        return &m_slots[m_fdSlots[fd]];
+    }
+
+    File *findDevpath(const std::string &devpath)
+    {
+        const std::unordered_map<std::string, uint32_t>::const_iterator it = m_devpathSlots.find(devpath);
+        return it == m_devpathSlots.end() ? nullptr : &m_slots[it->second];
+    }
+
+    File *findDevnum(const dev_t devnum)
+    {
+        const std::unordered_map<dev_t, uint32_t>::const_iterator it = m_devnumSlots.find(devnum);
+        return it == m_devnumSlots.end() ? nullptr : &m_slots[it->second];
+    }
+
+    size_t size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+
+    // It's fine to remove keyboards from func, but not to add them
+    template<typename Func>
+    void forEach(Func &&func)
+    {
+        for (File &keyboard : m_slots) {
+            if (keyboard.isOpen()) {
+                func(&keyboard);
+            }
+        }
+    }
+
+private:
+    std::deque<File> m_slots;
+    std::vector<uint32_t> m_freeSlots;
+    size_t m_count = 0;
+
+    // fds are small and dense, so just index by them
+    std::vector<uint32_t> m_fdSlots;
+    std::unordered_map<std::string, uint32_t> m_devpathSlots;
+    std::unordered_map<dev_t, uint32_t> m_devnumSlots;
+};
+
+// Opens a keyboard and sets it up, returns a closed File if it failed or if
+// it can't send any of the keys. Can be called from any thread, it doesn't
+// touch any of our state.
+static File openKeyboardFile(const std::string &path, const std::string &devpath, const KeySet &interestingKeys)
+{
+    File file(path, true);
+    if (!file.isOpen()) {
+        return file;
+    }
+    if (!file.keyBits.intersects(interestingKeys)) {
+        if (s_verbose) logPrint("%s can't send any of the keys we use, closing\n", path);
+        return File();
+    }
+    file.setKeyMask(interestingKeys);
+    struct stat info;
+    if (fstat(file.fd, &info) == 0) {
+        file.devnum = info.st_rdev;
+    }
+    file.devpath = devpath;
+    return file;
+}
+
+// Starts handling events from a keyboard that has been opened
+static File *addKeyboard(File &&file, const KeySet &interestingKeys, DeviceRegistry *registry, EventLoop *eventLoop, ShortcutTable *shortcuts)
+{
+    // The config might have changed while it was being opened
+    if (file.keyMask != interestingKeys) {
+        file.setKeyMask(interestingKeys);
+    }
+    if (!eventLoop->addDevice(file.fd)) {
+        return nullptr;
+    }
+    file.id = s_nextKeyboardId++;
+    if (s_verbose) logPrint("%s is keyboard %u\n", file.filename(), file.id);
+    File *keyboard = registry->add(std::move(file));
+
+    // Something might be held down already
+    resyncKeys(keyboard, shortcuts);
+    keyboard->lastRead = secondsSinceBoot();
+    return keyboard;
+}
+
+// Returns null if it failed, or if the device can't send any of the keys
+static File *openKeyboard(const std::string &path, const std::string &devpath, const KeySet &interestingKeys, DeviceRegistry *registry, EventLoop *eventLoop, ShortcutTable *shortcuts)
+{
+    if (registry->findDevpath(devpath)) {
+        if (s_veryVerbose) logPrint("%s already added\n", path);
+        return nullptr;
+    }
+    File file = openKeyboardFile(path, devpath, interestingKeys);
+    if (!file.isOpen()) {
+        return nullptr;
+    }
+    return addKeyboard(std::move(file), interestingKeys, registry, eventLoop, shortcuts);
+}
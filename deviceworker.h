@@ -0,0 +1,219 @@
+#pragma once
+
+#include "keyboard.h"
+#include "deviceregistry.h"
+#include "eventloop.h"
+#include "keyset.h"
+#include "backgroundthread.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+extern "C" {
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdio.h>
+}
+
+// Opens and closes keyboards on a separate thread, because both can take a
+// long time (closing in particular), and we don't want a slow or stuck
+// driver to hold up the keys from all the other keyboards.
+//
+// When something has been opened notifyFd becomes readable, and the main
+// loop picks it up with takeOpened(). Everything except the worker thread
+// itself is only used from the main loop.
+struct DeviceWorker
+{
+    struct Opened {
+        File file;
+        uint64_t generation = 0;
+    };
+
+    DeviceWorker()
+    {
+        notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notifyFd == -1) {
+            perror("Failed to create eventfd for device worker");
+            return;
+        }
+
+        m_thread = startBackgroundThread(&DeviceWorker::run, this);
+    }
+
+    ~DeviceWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_one();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (notifyFd != -1) {
+            ::close(notifyFd);
+        }
+    }
+
+    DeviceWorker(const DeviceWorker &) = delete;
+    DeviceWorker &operator=(const DeviceWorker &) = delete;
+
+    bool isValid() const { return notifyFd != -1; }
+
+    void open(const std::string &path, const std::string &devpath, const KeySet &interestingKeys)
+    {
+        // If it's removed and added again before we're done, the first one is
+        // stale when it comes back
+        const uint64_t generation = ++m_generation;
+        m_pending[devpath] = generation;
+
+        Job job;
+        job.path = path;
+        job.devpath = devpath;
+        job.interestingKeys = interestingKeys;
+        job.generation = generation;
+        queue(std::move(job));
+    }
+
+    // Takes over the file, and closes it
+    void close(File &&file)
+    {
+        Job job;
+        job.file = std::move(file);
+        queue(std::move(job));
+    }
+
+    bool isOpening(const std::string &devpath) const { return m_pending.contains(devpath); }
+
+    // If it's removed while we're opening it
+    void cancelOpen(const std::string &devpath) { m_pending.erase(devpath); }
+
+    // Returns what has been opened since last time. Stale ones (cancelled, or
+    // replaced by a newer open) are closed, and failed ones are skipped.
+    std::vector<File> takeOpened()
+    {
+        uint64_t count;
+        while (::read(notifyFd, &count, sizeof(count)) > 0) {}
+
+        std::deque<Opened> opened;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            opened.swap(m_opened);
+        }
+
+        std::vector<File> ret;
+        for (Opened &result : opened) {
+            const std::unordered_map<std::string, uint64_t>::iterator it = m_pending.find(result.file.devpath);
+            if (it == m_pending.end() || it->second != result.generation) {
+                if (result.file.isOpen()) {
+                    if (s_verbose) logPrint("%s was opened too late, closing\n", result.file.filename());
+                    close(std::move(result.file));
+                }
+                continue;
+            }
+            m_pending.erase(it);
+            if (result.file.isOpen()) {
+                ret.push_back(std::move(result.file));
+            }
+        }
+        return ret;
+    }
+
+    int notifyFd = -1;
+
+private:
+    // Opens if the path is set, otherwise closes the file
+    struct Job {
+        std::string path;
+        std::string devpath;
+        KeySet interestingKeys;
+        uint64_t generation = 0;
+        File file;
+    };
+
+    void queue(Job &&job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_wakeup.notify_one();
+    }
+
+    void run()
+    {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeup.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+                if (m_jobs.empty()) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+
+            if (job.path.empty()) {
+                closeFile(&job.file);
+                continue;
+            }
+
+            Opened result;
+            result.file = openKeyboardFile(job.path, job.devpath, job.interestingKeys);
+            // So the main loop knows which one it was, even if it failed
+            result.file.devpath = job.devpath;
+            result.generation = job.generation;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_opened.push_back(std::move(result));
+            }
+            const uint64_t one = 1;
+            if (::write(notifyFd, &one, sizeof(one)) != sizeof(one)) {
+                perror("Failed to notify about opened keyboard");
+            }
+        }
+    }
+
+    static void closeFile(File *file)
+    {
+        if (!file->isOpen()) {
+            return;
+        }
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ::close(file->fd);
+        file->fd = -1;
+        if (s_verbose) {
+            const long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            logPrint("Closed %s in %ld ms\n", file->filename(), ms);
+        }
+    }
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stopping = false;
+
+    // Protected by m_mutex
+    std::deque<Job> m_jobs;
+    std::deque<Opened> m_opened;
+
+    // Only used from the main loop
+    uint64_t m_generation = 0;
+    std::unordered_map<std::string, uint64_t> m_pending;
+};
+
+// Forgets about it straight away, the worker does the actual closing
+static void closeKeyboard(File *keyboard, DeviceRegistry *registry, EventLoop *eventLoop, DeviceWorker *worker, ShortcutTable *shortcuts)
+{
+    // Whatever was held down on it isn't anymore
+    setKeys(keyboard, KeySet(), shortcuts);
+    eventLoop->remove(keyboard->fd);
+    worker->close(registry->take(keyboard));
+}
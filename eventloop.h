@@ -0,0 +1,93 @@
+#pragma once
+
+extern "C" {
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+}
+
+// What the main loop waits on. File descriptors are registered once, and
+// wait() only gives back the ones that are actually ready.
+struct EventLoop
+{
+    static constexpr int MaxEvents = 64;
+
+    EventLoop() = default;
+    virtual ~EventLoop() = default;
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    virtual bool isValid() const = 0;
+
+    // For things we only need to know are readable (udev, inotify etc.)
+    virtual bool add(const int fd) = 0;
+
+    // For keyboards, that we read input_events from. Some backends read them
+    // for us, see UringEventLoop.
+    virtual bool addDevice(const int fd) { return add(fd); }
+
+    virtual void remove(const int fd) = 0;
+
+    // Returns the number of fds in readyFds, or -1 on error (e. g. EINTR)
+    virtual int wait(const int timeoutMs) = 0;
+
+    int readyFds[MaxEvents];
+};
+
+// Thin wrapper around epoll. No FD_SETSIZE limit, and we don't need to scan
+// everything to find what woke us up.
+struct EpollEventLoop : EventLoop
+{
+    EpollEventLoop()
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd == -1) {
+            perror("Failed to create epoll instance");
+        }
+    }
+
+    ~EpollEventLoop()
+    {
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+    }
+
+    bool isValid() const override { return epollFd != -1; }
+
+    bool add(const int fd) override
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("Failed to add fd to event loop");
+            return false;
+        }
+        return true;
+    }
+
+    void remove(const int fd) override
+    {
+        // Need to do this explicitly, closing the fd isn't enough if a child
+        // we forked still has it open.
+        if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr) == -1 && errno != ENOENT) {
+            perror("Failed to remove fd from event loop");
+        }
+    }
+
+    int wait(const int timeoutMs) override
+    {
+        const int ret = epoll_wait(epollFd, events, MaxEvents, timeoutMs);
+        for (int i=0; i<ret; i++) {
+            readyFds[i] = events[i].data.fd;
+        }
+        return ret;
+    }
+
+    epoll_event events[MaxEvents];
+
+    int epollFd = -1;
+};
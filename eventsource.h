@@ -0,0 +1,237 @@
+#pragma once
+
+#include "log.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+extern "C" {
+#include <linux/input.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+}
+
+// Where the key events come from. Normally that's just reading from the
+// evdev device, but they can also be recorded to or replayed from a trace.
+struct EventSource
+{
+    virtual ~EventSource() = default;
+
+    // Like read(), but in events, and device is our id for the keyboard.
+    // Returns the number of events, or -1 with errno set (EAGAIN if there's
+    // nothing more right now).
+    virtual ssize_t read(const int fd, const uint32_t device, input_event *events, const size_t count) = 0;
+};
+
+struct LiveEventSource : EventSource
+{
+    ssize_t read(const int fd, const uint32_t, input_event *events, const size_t count) override
+    {
+        const ssize_t ret = ::read(fd, events, count * sizeof(input_event));
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0) {
+            // Only fifos (fake keyboards) do this, when the other end is gone
+            errno = ENODEV;
+            return -1;
+        }
+        if (ret % sizeof(input_event) != 0) {
+            logError("Short read (%zd bytes)\n", ret);
+            errno = EIO;
+            return -1;
+        }
+        return ret / sizeof(input_event);
+    }
+};
+
+// The trace format is a header followed by fixed size records, so a trace can
+// just be mmap'ed and used directly. Everything is native endian, it's not
+// meant to be moved between machines.
+struct TraceHeader
+{
+    static constexpr char Magic[8] = { 'S', 'S', 'T', 'R', 'A', 'C', 'E', '\0' };
+    static constexpr uint32_t CurrentVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+struct TraceRecord
+{
+    uint64_t time; // nanoseconds, from the event
+    uint32_t device;
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+    uint32_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 24);
+static_assert(sizeof(TraceHeader) % alignof(TraceRecord) == 0);
+
+// Passes the events through from another source, and writes them to a trace
+struct TraceRecorder : EventSource
+{
+    TraceRecorder(EventSource *source, const std::string &path) : m_source(source)
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror(("Failed to create trace " + path).c_str());
+            return;
+        }
+
+        TraceHeader header = {};
+        memcpy(header.magic, TraceHeader::Magic, sizeof(header.magic));
+        header.version = TraceHeader::CurrentVersion;
+        header.recordSize = sizeof(TraceRecord);
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            perror(("Failed to write trace header to " + path).c_str());
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~TraceRecorder()
+    {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    bool isValid() const { return fd != -1; }
+
+    ssize_t read(const int fd, const uint32_t device, input_event *events, const size_t count) override
+    {
+        const ssize_t ret = m_source->read(fd, device, events, count);
+        if (ret > 0) {
+            record(device, events, ret);
+        }
+        return ret;
+    }
+
+    // Written straight away, so nothing is lost if we're killed
+    void record(const uint32_t device, const input_event *events, const size_t count)
+    {
+        if (fd == -1) {
+            return;
+        }
+        m_buffer.resize(count);
+        for (size_t i=0; i<count; i++) {
+            TraceRecord &record = m_buffer[i];
+            record = {};
+            record.time = events[i].input_event_sec * 1000000000UL + events[i].input_event_usec * 1000UL;
+            record.device = device;
+            record.type = events[i].type;
+            record.code = events[i].code;
+            record.value = events[i].value;
+        }
+        const ssize_t size = count * sizeof(TraceRecord);
+        if (write(fd, m_buffer.data(), size) != size) {
+            logError("Failed to write trace, stopping recording: %s\n", strerrordesc_np(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    int fd = -1;
+
+private:
+    EventSource *m_source;
+    std::vector<TraceRecord> m_buffer;
+};
+
+// Plays back a trace as fast as possible. read() returns the events up to
+// where the next one is from another device, so check nextDevice() to see
+// who's next.
+struct TraceReplayer : EventSource
+{
+    TraceReplayer(const std::string &path)
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(("Failed to open trace " + path).c_str());
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1 || size_t(info.st_size) < sizeof(TraceHeader)) {
+            fprintf(stderr, "Invalid trace %s\n", path.c_str());
+            close(fd);
+            return;
+        }
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            perror(("Failed to map trace " + path).c_str());
+            return;
+        }
+        m_mapped = mapped;
+        m_mappedSize = info.st_size;
+
+        const TraceHeader *header = static_cast<const TraceHeader*>(m_mapped);
+        if (memcmp(header->magic, TraceHeader::Magic, sizeof(header->magic)) != 0 ||
+                header->version != TraceHeader::CurrentVersion ||
+                header->recordSize != sizeof(TraceRecord)) {
+            fprintf(stderr, "%s is not a trace we understand\n", path.c_str());
+            return;
+        }
+
+        m_begin = reinterpret_cast<const TraceRecord*>(header + 1);
+        m_end = m_begin + (m_mappedSize - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        m_next = m_begin;
+    }
+
+    ~TraceReplayer()
+    {
+        if (m_mapped) {
+            munmap(m_mapped, m_mappedSize);
+        }
+    }
+
+    TraceReplayer(const TraceReplayer &) = delete;
+    TraceReplayer &operator=(const TraceReplayer &) = delete;
+
+    bool isValid() const { return m_begin != nullptr; }
+    bool atEnd() const { return m_next == m_end; }
+    size_t size() const { return m_end - m_begin; }
+    uint32_t nextDevice() const { return m_next->device; }
+
+    // Start over from the beginning
+    void rewind() { m_next = m_begin; }
+
+    ssize_t read(const int, const uint32_t device, input_event *events, const size_t count) override
+    {
+        size_t ret = 0;
+        while (ret < count && m_next != m_end && m_next->device == device) {
+            input_event &event = events[ret++];
+            event.input_event_sec = m_next->time / 1000000000UL;
+            event.input_event_usec = (m_next->time % 1000000000UL) / 1000;
+            event.type = m_next->type;
+            event.code = m_next->code;
+            event.value = m_next->value;
+            m_next++;
+        }
+        if (ret == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return ret;
+    }
+
+private:
+    void *m_mapped = nullptr;
+    size_t m_mappedSize = 0;
+
+    const TraceRecord *m_begin = nullptr;
+    const TraceRecord *m_end = nullptr;
+    const TraceRecord *m_next = nullptr;
+};
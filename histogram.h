@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+extern "C" {
+#include <stdio.h>
+}
+
+// Latency histogram in the style of HdrHistogram: values below SubBuckets get
+// a bucket each, above that every power of two is split into SubBuckets
+// buckets, so the precision is ~6% at any scale and recording is just a
+// couple of instructions and an atomic increment. Nothing is ever allocated
+// or locked, so it's safe to record from anywhere.
+struct Histogram
+{
+    static constexpr int SubBucketBits = 4;
+    static constexpr uint64_t SubBuckets = 1 << SubBucketBits;
+    static constexpr size_t BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+    static size_t bucketFor(const uint64_t value)
+    {
+        if (value < SubBuckets) {
+            return value;
+        }
+        const int shift = 63 - __builtin_clzll(value) - SubBucketBits;
+        return (shift + 1) * SubBuckets + ((value >> shift) & (SubBuckets - 1));
+    }
+
+    // The highest value that ends up in the bucket
+    static uint64_t highestFor(const size_t bucket)
+    {
+        if (bucket < SubBuckets) {
+            return bucket;
+        }
+        const int shift = bucket / SubBuckets - 1;
+        const uint64_t lowest = (SubBuckets + bucket % SubBuckets) << shift;
+        return lowest + (uint64_t(1) << shift) - 1;
+    }
+
+    // Negative values (clocks going backwards etc.) count as 0
+    void record(const int64_t value)
+    {
+        const uint64_t clamped = value > 0 ? value : 0;
+        counts[bucketFor(clamped)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(clamped, std::memory_order_relaxed);
+
+        uint64_t currentMax = max.load(std::memory_order_relaxed);
+        while (clamped > currentMax && !max.compare_exchange_weak(currentMax, clamped, std::memory_order_relaxed)) {}
+    }
+
+    // Approximate, might be off by a bit if someone is recording at the same time
+    uint64_t percentile(const double percent) const
+    {
+        const uint64_t total = count.load(std::memory_order_relaxed);
+        if (total == 0) {
+            return 0;
+        }
+        const uint64_t wanted = uint64_t(total * percent / 100. + 0.5);
+        uint64_t seen = 0;
+        for (size_t i=0; i<BucketCount; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= wanted && seen > 0) {
+                return std::min(highestFor(i), max.load(std::memory_order_relaxed));
+            }
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+
+    // Values are in nanoseconds, printed in microseconds
+    void print(const char *name) const
+    {
+        printf("%-16s %8lu samples, p50 %8.1f us, p90 %8.1f us, p99 %8.1f us, p99.9 %8.1f us, max %8.1f us\n",
+                name, count.load(std::memory_order_relaxed),
+                percentile(50) / 1000., percentile(90) / 1000., percentile(99) / 1000.,
+                percentile(99.9) / 1000., max.load(std::memory_order_relaxed) / 1000.);
+    }
+
+    std::atomic<uint64_t> counts[BucketCount] = {};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+};
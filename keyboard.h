@@ -0,0 +1,320 @@
+#pragma once
+
+#include "keyset.h"
+#include "keys.h"
+#include "shortcuts.h"
+#include "keystate.h"
+#include "pipeline.h"
+#include "eventloop.h"
+#include "eventsource.h"
+#include "stats.h"
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+}
+
+struct File
+{
+    // Not backed by anything, e. g. when replaying a trace
+    File() = default;
+
+    File (const std::string &filename, bool keyboard, const int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC) : m_filename(filename) {
+        fd = open(filename.c_str(), flags, 0644);
+
+        if (fd == -1) {
+            perror(("Failed to open " + filename).c_str());
+            return;
+        }
+
+        struct stat info;
+        if (keyboard && fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode)) {
+            // Fake keyboard for testing, see UdevConnection
+            fake = true;
+            keyBits = KeySet::all();
+        } else if (keyboard) {
+            int ret = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBits.words)), keyBits.words);
+            if (ret < 0) {
+                perror(("Failed to get key bits from " + filename).c_str());
+                close(fd);
+                fd = -1;
+                return;
+            }
+
+            // So we can compare the event timestamps with our own clock
+            int clock = CLOCK_MONOTONIC;
+            monotonic = ioctl(fd, EVIOCSCLOCKID, &clock) == 0;
+            if (!monotonic && s_verbose) perror(("Failed to set clock for " + filename).c_str());
+        }
+
+        if (s_verbose) logPrint("Opened %s\n", m_filename);
+    }
+
+    ~File() {
+        if (fd != -1) {
+            // Closing is very slow, for some reason
+            if (s_verbose) logPrint("Closing %d\n", fd);
+            close(fd);
+        }
+    }
+
+    File(File&& other) :
+        keyBits(other.keyBits),
+        keyMask(other.keyMask),
+        pressedKeys(other.pressedKeys),
+        dropped(other.dropped),
+        lastRead(other.lastRead),
+        monotonic(other.monotonic),
+        fake(other.fake),
+        id(other.id),
+        eventsRead(other.eventsRead),
+        devpath(std::move(other.devpath)),
+        devnum(other.devnum),
+        m_filename(std::move(other.m_filename))
+    {
+        fd = other.fd;
+        other.fd = -1;
+    }
+
+    File &operator=(File &&other) {
+        // DeviceRegistry moves keyboards in and out of its slots, don't
+        // leak the one we replace
+        if (fd != -1 && fd != other.fd) {
+            close(fd);
+        }
+        m_filename = std::move(other.m_filename);
+        fd = other.fd;
+        keyBits = other.keyBits;
+        keyMask = other.keyMask;
+        pressedKeys = other.pressedKeys;
+        dropped = other.dropped;
+        lastRead = other.lastRead;
+        monotonic = other.monotonic;
+        fake = other.fake;
+        id = other.id;
+        eventsRead = other.eventsRead;
+        devpath = std::move(other.devpath);
+        devnum = other.devnum;
+        other.fd = -1;
+        return *this;
+    }
+
+    // Tell the kernel to only send us the key events we care about, so mice
+    // and whatnot don't wake us up for nothing. EV_SYN is never filtered.
+    void setKeyMask(const KeySet &keys) {
+        keyMask = keys;
+        if (fake) {
+            return;
+        }
+
+        uint64_t types = uint64_t(1) << EV_KEY;
+        input_mask mask = {};
+        mask.type = 0; // The mask for the event types
+        mask.codes_size = sizeof(types);
+        mask.codes_ptr = reinterpret_cast<uintptr_t>(&types);
+        if (ioctl(fd, EVIOCSMASK, &mask) == -1) {
+            // Old kernel, not the end of the world
+            if (s_verbose) perror(("Failed to set event type mask for " + m_filename).c_str());
+            return;
+        }
+
+        mask.type = EV_KEY;
+        mask.codes_size = sizeof(keys.words);
+        mask.codes_ptr = reinterpret_cast<uintptr_t>(keys.words);
+        if (ioctl(fd, EVIOCSMASK, &mask) == -1) {
+            if (s_verbose) perror(("Failed to set key mask for " + m_filename).c_str());
+        }
+    }
+
+    void unlink() {
+        if (unlinkat(fd, m_filename.c_str(), 0) == -1) {
+            perror(("Failed to unlink " + m_filename).c_str());
+        }
+    }
+
+    File(const File &) = delete;
+    File &operator=(const File &) = delete;
+
+    bool isOpen() { return fd != -1; }
+
+    int fd = -1;
+
+    // The keys a keyboard can send
+    KeySet keyBits;
+
+    // The keys we've asked the kernel for
+    KeySet keyMask = KeySet::all();
+
+    // What we think is held down on this keyboard
+    KeySet pressedKeys;
+
+    // If we're skipping events until the next SYN_REPORT
+    bool dropped = false;
+
+    // When we last read from it, in seconds since boot
+    int64_t lastRead = 0;
+
+    // If the event timestamps are CLOCK_MONOTONIC
+    bool monotonic = false;
+
+    // A fifo pretending to be a keyboard, there's nothing to ask the kernel
+    bool fake = false;
+
+    // Which keyboard it is in traces
+    uint32_t id = 0;
+
+    // Only touched by the main loop
+    uint64_t eventsRead = 0;
+
+    // What udev calls it, and the device number, to find it when it's removed
+    std::string devpath;
+    dev_t devnum = 0;
+
+    const std::string &filename() const { return m_filename; }
+
+private:
+    std::string m_filename;
+};
+
+// Includes time spent suspended, which is when we're most likely to miss
+// a key being released
+[[maybe_unused]] static int64_t secondsSinceBoot()
+{
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return now.tv_sec;
+}
+
+static void setKey(File *keyboard, const uint16_t code, const bool pressed, ShortcutTable *shortcuts)
+{
+    if (keyboard->pressedKeys.test(code) == pressed) {
+        return;
+    }
+    keyboard->pressedKeys.set(code, pressed);
+
+    if (s_pipeline.isRunning()) {
+        // The matcher thread takes it from here
+        s_pipeline.setKey(code, pressed, s_eventTime, s_readTime);
+        return;
+    }
+    setPressed(code, pressed, shortcuts, &activate);
+}
+
+static void setKeys(File *keyboard, const KeySet &keys, ShortcutTable *shortcuts)
+{
+    KeySet released = keyboard->pressedKeys;
+    released.subtract(keys);
+    KeySet pressed = keys;
+    pressed.subtract(keyboard->pressedKeys);
+
+    // Releases first, so we never see a combination that wasn't held down
+    released.forEach([&](const uint16_t code) {
+        setKey(keyboard, code, false, shortcuts);
+    });
+    pressed.forEach([&](const uint16_t code) {
+        setKey(keyboard, code, true, shortcuts);
+    });
+}
+
+// Gets what's actually held down on the keyboard from the kernel, when we
+// might have missed something.
+static bool resyncKeys(File *keyboard, ShortcutTable *shortcuts)
+{
+    if (keyboard->fake) {
+        return false;
+    }
+    KeySet keys;
+    if (ioctl(keyboard->fd, EVIOCGKEY(sizeof(keys.words)), keys.words) == -1) {
+        perror(("Failed to get key state from " + keyboard->filename()).c_str());
+        return false;
+    }
+    // We don't get events for the others, so don't track them
+    keys.intersect(keyboard->keyMask);
+    if (s_verbose) logPrint("Resyncing %s\n", keyboard->filename());
+    s_eventTime = 0;
+    s_readTime = monotonicNanoseconds();
+    setKeys(keyboard, keys, shortcuts);
+    s_wakeups.resyncs++;
+    return true;
+}
+
+static bool handleKey(File *keyboard, ShortcutTable *shortcuts, EventSource *source)
+{
+    // Keyboards usually send MSC_SCAN + KEY + SYN for every key press, so
+    // read as much as we can in one go instead of one event per syscall.
+    input_event events[64];
+    while (true) {
+        const ssize_t ret = source->read(keyboard->fd, keyboard->id, events, std::size(events));
+        if (ret == -1) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+            if (errno != ENODEV || s_verbose) perror("Failed to read events");
+            return false;
+        }
+        if (ret == 0) {
+            logError("Got no events from %s\n", keyboard->filename());
+            errno = EIO;
+            return false;
+        }
+        s_readTime = monotonicNanoseconds();
+
+        const size_t count = ret;
+        keyboard->eventsRead += count;
+        s_counters.eventsRead.add(count);
+        for (size_t i=0; i<count; i++) {
+            const input_event &iev = events[i];
+            if (iev.type == EV_SYN && iev.code == SYN_DROPPED) {
+                s_counters.droppedEvents.add();
+                logError("Got dropped events from %s!\n", keyboard->filename());
+                // Ignore everything until the next complete report, and
+                // then ask the kernel what's actually held down.
+                keyboard->dropped = true;
+                continue;
+            }
+            if (keyboard->dropped) {
+                if (iev.type == EV_SYN && iev.code == SYN_REPORT) {
+                    keyboard->dropped = false;
+                    resyncKeys(keyboard, shortcuts);
+                }
+                continue;
+            }
+            if (iev.type != EV_KEY) {
+                s_counters.nonKeyEvents.add();
+                if (s_veryVerbose) logPrint("Wrong event type %d (%d: %d) ", iev.type, iev.code, iev.value);
+                continue;
+            }
+            if (s_veryVerbose) logPrint("Correct event type %d (%d: %d) ", iev.type, iev.code, iev.value);
+            if (iev.code >= KEY_CNT) {
+                logPrint("Invalid key %d\n", iev.code);
+                continue;
+            }
+            if (!keyboard->keyMask.test(iev.code)) {
+                // Old kernel without EVIOCSMASK
+                continue;
+            }
+            if (keyboard->monotonic) {
+                s_eventTime = iev.input_event_sec * 1000000000L + iev.input_event_usec * 1000L;
+                s_latency.kernel.record(s_readTime - s_eventTime);
+            } else {
+                s_eventTime = 0;
+            }
+            setKey(keyboard, iev.code, iev.value, shortcuts);
+            if (s_verbose) logPrint("key %s has state %d\n", getKeyName(iev.code), iev.value);
+        }
+
+        // If we didn't fill the buffer we got everything that was queued, so
+        // don't waste a syscall on getting EAGAIN back.
+        if (count < std::size(events)) {
+            return true;
+        }
+    }
+    return true;
+}
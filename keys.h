@@ -4,11 +4,17 @@ extern "C" {
 #include <linux/input.h>
 }
 
-#include "utils.h"
+#include <string_view>
+#include <algorithm>
+#include <array>
+#include <cstdint>
 
-#include <map>
+struct KeyName {
+    std::string_view name;
+    uint16_t code;
+};
 
-static const std::map<std::string, uint16_t> key_conversion_table =
+static constexpr KeyName key_conversion_table[] =
 {
     {"ESC", KEY_ESC},
     {"1", KEY_1},
@@ -509,39 +515,140 @@ static const std::map<std::string, uint16_t> key_conversion_table =
     {"MIC_MUTE", KEY_F20}
 };
 
-template<typename T, typename V>
-static std::map<T, V> reverseMapping(const std::map<V, T> &mapping)
+namespace keys_detail
 {
-    std::map<T, V> ret;
-    for (const std::pair<const V, T> &entry : mapping) {
-        ret[entry.second] = entry.first;
+    constexpr char uppercase(const char c) { return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c; }
+
+    // FNV-1a with a seed, and murmur's finalizer to spread the bits. Case
+    // insensitive, all the names in the table are uppercase.
+    constexpr uint32_t hash(const std::string_view name, const uint32_t seed)
+    {
+        uint32_t hash = 2166136261u ^ seed;
+        for (const char c : name) {
+            hash ^= uint8_t(uppercase(c));
+            hash *= 16777619u;
+        }
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35u;
+        hash ^= hash >> 16;
+        return hash;
     }
 
-    return ret;
-}
+    constexpr bool equalsUppercase(const std::string_view input, const std::string_view name)
+    {
+        if (input.size() != name.size()) {
+            return false;
+        }
+        for (size_t i=0; i<input.size(); i++) {
+            if (uppercase(input[i]) != name[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-// Don't need to account for invalid enums
-template<typename T>
-static std::string lookupString(const T val, const std::map<T, std::string> &map)
-{
-    typename std::map<T, std::string>::const_iterator it = map.find(val);
-    if (it == map.end()) {
-        return "[UNKNOWN: " + std::to_string(val) + "]";
+    // Perfect hash for the names, generated at compile time (hash and
+    // displace). Every name first hashes to a bucket, and every bucket has a
+    // seed chosen so that all the names in it hash to free slots.
+    struct NameHash {
+        static constexpr size_t BucketCount = 128;
+        static constexpr size_t SlotCount = 1024;
+        static constexpr uint16_t Empty = 0xffff;
+
+        uint32_t seeds[BucketCount] = {};
+        uint16_t slots[SlotCount] = {};
+    };
+
+    constexpr NameHash buildNameHash()
+    {
+        constexpr size_t count = std::size(key_conversion_table);
+        static_assert(count < NameHash::SlotCount);
+
+        NameHash ret;
+        for (uint16_t &slot : ret.slots) {
+            slot = NameHash::Empty;
+        }
+
+        size_t bucketSizes[NameHash::BucketCount] = {};
+        size_t largestBucket = 0;
+        for (const KeyName &key : key_conversion_table) {
+            const size_t bucket = hash(key.name, 0) % NameHash::BucketCount;
+            largestBucket = std::max(largestBucket, ++bucketSizes[bucket]);
+        }
+
+        // Biggest buckets first, while there's still plenty of free slots
+        for (size_t size = largestBucket; size > 0; size--) {
+            for (size_t bucket = 0; bucket < NameHash::BucketCount; bucket++) {
+                if (bucketSizes[bucket] != size) {
+                    continue;
+                }
+
+                uint16_t members[NameHash::SlotCount] = {};
+                size_t memberCount = 0;
+                for (size_t i=0; i<count; i++) {
+                    if (hash(key_conversion_table[i].name, 0) % NameHash::BucketCount == bucket) {
+                        members[memberCount++] = i;
+                    }
+                }
+
+                for (uint32_t seed = 1; ; seed++) {
+                    if (seed > 1000000) {
+                        throw "Failed to find a perfect hash for the key names";
+                    }
+                    size_t used[NameHash::SlotCount] = {};
+                    bool ok = true;
+                    for (size_t i=0; i<memberCount && ok; i++) {
+                        const size_t slot = hash(key_conversion_table[members[i]].name, seed) % NameHash::SlotCount;
+                        ok = ret.slots[slot] == NameHash::Empty && !used[slot];
+                        used[slot] = true;
+                    }
+                    if (!ok) {
+                        continue;
+                    }
+                    for (size_t i=0; i<memberCount; i++) {
+                        ret.slots[hash(key_conversion_table[members[i]].name, seed) % NameHash::SlotCount] = members[i];
+                    }
+                    ret.seeds[bucket] = seed;
+                    break;
+                }
+            }
+        }
+        return ret;
     }
-    return it->second;
-}
 
-static int getKeyCode(const std::string &input)
-{
-    std::map<std::string, uint16_t>::const_iterator it = key_conversion_table.find(std_sux::uppercase(input));
-    if (it != key_conversion_table.end()) {
-        return it->second;
+    // Some keys have several names, pick the one that sorts last so it
+    // matches what we've always printed.
+    constexpr std::array<std::string_view, KEY_CNT> buildKeyNames()
+    {
+        std::array<std::string_view, KEY_CNT> ret = {};
+        for (const KeyName &key : key_conversion_table) {
+            if (key.name > ret[key.code]) {
+                ret[key.code] = key.name;
+            }
+        }
+        return ret;
     }
+}// namespace keys_detail
 
-    return -1;
+static constexpr keys_detail::NameHash key_name_hash = keys_detail::buildNameHash();
+static constexpr std::array<std::string_view, KEY_CNT> key_names = keys_detail::buildKeyNames();
+
+static int getKeyCode(const std::string_view input)
+{
+    const uint32_t seed = key_name_hash.seeds[keys_detail::hash(input, 0) % key_name_hash.BucketCount];
+    const uint16_t index = key_name_hash.slots[keys_detail::hash(input, seed) % key_name_hash.SlotCount];
+    if (index == key_name_hash.Empty || !keys_detail::equalsUppercase(input, key_conversion_table[index].name)) {
+        return -1;
+    }
+    return key_conversion_table[index].code;
 }
 
-static std::string getKeyName(const uint16_t keycode)
+static std::string_view getKeyName(const uint16_t keycode)
 {
-    return lookupString(keycode, reverseMapping(key_conversion_table));
+    if (keycode >= KEY_CNT || key_names[keycode].empty()) {
+        return "[UNKNOWN]";
+    }
+    return key_names[keycode];
 }
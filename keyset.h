@@ -0,0 +1,84 @@
+#pragma once
+
+extern "C" {
+#include <linux/input.h>
+#include <string.h>
+}
+
+#include <cstdint>
+#include <cstddef>
+
+// One bit per key code, 96 bytes instead of a bool per key
+struct KeySet
+{
+    static constexpr size_t WordCount = (KEY_CNT + 63) / 64;
+
+    static constexpr uint64_t bit(const uint16_t code) { return uint64_t(1) << (code % 64); }
+
+    bool test(const uint16_t code) const { return words[code / 64] & bit(code); }
+    void set(const uint16_t code) { words[code / 64] |= bit(code); }
+    void reset(const uint16_t code) { words[code / 64] &= ~bit(code); }
+    void set(const uint16_t code, const bool value) { value ? set(code) : reset(code); }
+
+    void clear() { memset(words, 0, sizeof(words)); }
+
+    bool operator==(const KeySet &other) const = default;
+
+    bool any() const
+    {
+        uint64_t ret = 0;
+        for (const uint64_t word : words) {
+            ret |= word;
+        }
+        return ret != 0;
+    }
+
+    bool intersects(const KeySet &other) const
+    {
+        uint64_t ret = 0;
+        for (size_t i=0; i<WordCount; i++) {
+            ret |= words[i] & other.words[i];
+        }
+        return ret != 0;
+    }
+
+    // Removes everything that isn't in other
+    void intersect(const KeySet &other)
+    {
+        for (size_t i=0; i<WordCount; i++) {
+            words[i] &= other.words[i];
+        }
+    }
+
+    // Removes everything that is in other
+    void subtract(const KeySet &other)
+    {
+        for (size_t i=0; i<WordCount; i++) {
+            words[i] &= ~other.words[i];
+        }
+    }
+
+    static KeySet all()
+    {
+        KeySet ret;
+        for (size_t code=0; code<KEY_CNT; code++) {
+            ret.set(code);
+        }
+        return ret;
+    }
+
+    // Calls func for every key that is set, in order
+    template<typename Func>
+    void forEach(Func &&func) const
+    {
+        for (size_t i=0; i<WordCount; i++) {
+            uint64_t word = words[i];
+            while (word) {
+                func(uint16_t(i * 64 + __builtin_ctzll(word)));
+                word &= word - 1;
+            }
+        }
+    }
+
+    uint64_t words[WordCount] = {};
+};
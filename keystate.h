@@ -0,0 +1,80 @@
+#pragma once
+
+#include "keyset.h"
+#include "keys.h"
+#include "shortcuts.h"
+#include "launcher.h"
+#include "stats.h"
+
+#include <string_view>
+
+extern "C" {
+#include <stdio.h>
+}
+
+// What's held down on any keyboard, and on how many keyboards. With
+// --pipeline only the matcher thread touches these.
+static KeySet s_pressedKeys;
+static uint16_t s_pressedCount[KEY_CNT];
+static Launcher s_launcher;
+
+// matched is when the shortcut was activated, eventTime 0 if we don't know
+static void launchCommand(const Command &command, const int64_t eventTime, const int64_t matched)
+{
+    if (s_verbose) logPrint("Activated '%s'\n", command.text);
+    // The helper counts what it launches itself
+    if (!s_launcher.launch(command)) {
+        if (launch(command) == -1) {
+            s_counters.launchFailures.add();
+        } else {
+            s_counters.launches.add();
+        }
+    }
+
+    const int64_t launched = monotonicNanoseconds();
+    s_latency.launch.record(launched - matched);
+    if (eventTime) {
+        s_latency.total.record(launched - eventTime);
+    }
+}
+
+static void activate(const Shortcut &shortcut)
+{
+    const int64_t matched = monotonicNanoseconds();
+    s_latency.match.record(matched - s_readTime);
+    s_counters.activations.add();
+    launchCommand(shortcut.command, s_eventTime, matched);
+}
+
+// A key counts as pressed as long as it's held down on any keyboard, this is
+// called when it changes on one of them.
+template<typename Func>
+static void setPressed(const uint16_t code, const bool pressed, ShortcutTable *shortcuts, Func &&onActivated)
+{
+    if (pressed) {
+        if (s_pressedCount[code]++ != 0) {
+            return;
+        }
+    } else {
+        if (--s_pressedCount[code] != 0) {
+            return;
+        }
+    }
+    s_pressedKeys.set(code, pressed);
+    shortcuts->setKey(code, pressed, onActivated);
+}
+
+// For --printkeys
+static void printPressedKeys()
+{
+    // One record, so it doesn't get split up by other output
+    char line[Log::MaxString + 1];
+    size_t length = 0;
+    s_pressedKeys.forEach([&](const uint16_t code) {
+        const std::string_view name = getKeyName(code);
+        const int written = snprintf(line + length, sizeof(line) - length, "'%.*s' ", int(name.size()), name.data());
+        length = std::min(length + std::max(written, 0), sizeof(line) - 1);
+    });
+    line[length] = '\0';
+    logPrint("\033[2K\r%s", line);
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "command.h"
+#include "stats.h"
+
+#include <new>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <errno.h>
+}
+
+// Optional helper process that does the actual launching, so the main loop
+// only has to write a short message to a socket instead of creating a
+// process itself. It's forked once at startup, while we're still small.
+struct Launcher
+{
+    static constexpr size_t MaxCommandLength = 4096;
+    static constexpr size_t MaxArgs = 64;
+
+    struct Header {
+        timespec sent;
+    };
+
+    // Only the helper knows if spawning worked, so it counts in memory
+    // shared with us
+    struct Counters {
+        Counter launches;
+        Counter launchFailures;
+    };
+
+    Launcher() = default;
+
+    ~Launcher()
+    {
+        // The helper exits when it sees the other end going away
+        if (socketFd != -1) {
+            close(socketFd);
+        }
+        if (m_counters) {
+            munmap(m_counters, sizeof(Counters));
+        }
+    }
+
+    Launcher(const Launcher &) = delete;
+    Launcher &operator=(const Launcher &) = delete;
+
+    bool start()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+            perror("Failed to create socket for launcher helper");
+            return false;
+        }
+        void *shared = mmap(nullptr, sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) {
+            perror("Failed to map launcher helper counters");
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        m_counters = new (shared) Counters;
+
+        // Don't let the helper print whatever we have buffered again
+        fflush(stdout);
+
+        const pid_t pid = fork();
+        switch(pid) {
+        case 0:
+            close(fds[0]);
+            runHelper(fds[1], m_counters);
+            break;
+        case -1:
+            perror("Failed to fork launcher helper");
+            close(fds[0]);
+            close(fds[1]);
+            munmap(m_counters, sizeof(Counters));
+            m_counters = nullptr;
+            return false;
+        default:
+            break;
+        }
+
+        close(fds[1]);
+        socketFd = fds[0];
+        helperPid = pid;
+        if (s_verbose) printf("Started launcher helper, PID %d\n", pid);
+        return true;
+    }
+
+    bool isRunning() const { return socketFd != -1; }
+
+    // What the helper launched, these are not in s_counters
+    uint64_t launches() const { return m_counters ? m_counters->launches.get() : 0; }
+    uint64_t launchFailures() const { return m_counters ? m_counters->launchFailures.get() : 0; }
+
+    // Returns false if the helper can't take it, and the caller needs to
+    // launch it itself.
+    //
+    // The message is the header followed by the path and the arguments,
+    // each null terminated, so the helper can exec it as is.
+    bool launch(const Command &command)
+    {
+        // Builtins are cheaper to just do ourselves
+        if (socketFd == -1 || !command.isProcess() || command.args.size() > MaxArgs) {
+            return false;
+        }
+
+        Header header;
+        clock_gettime(CLOCK_MONOTONIC, &header.sent);
+
+        iovec parts[MaxArgs + 2];
+        parts[0].iov_base = &header;
+        parts[0].iov_len = sizeof(header);
+        parts[1].iov_base = const_cast<char*>(command.path.c_str());
+        parts[1].iov_len = command.path.size() + 1;
+        size_t length = parts[0].iov_len + parts[1].iov_len;
+        for (size_t i=0; i<command.args.size(); i++) {
+            parts[i + 2].iov_base = const_cast<char*>(command.args[i].c_str());
+            parts[i + 2].iov_len = command.args[i].size() + 1;
+            length += parts[i + 2].iov_len;
+        }
+        if (length > sizeof(Header) + MaxCommandLength) {
+            return false;
+        }
+
+        msghdr message = {};
+        message.msg_iov = parts;
+        message.msg_iovlen = command.args.size() + 2;
+
+        if (sendmsg(socketFd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) != ssize_t(length)) {
+            if (errno == EAGAIN) {
+                // The helper is busy, don't wait for it
+                if (s_verbose) logPrint("Launcher helper is busy\n");
+                return false;
+            }
+            perror("Launcher helper gone");
+            close(socketFd);
+            socketFd = -1;
+            return false;
+        }
+        if (s_verbose) logPrint(" -> Sent '%s' to launcher helper\n", command.text);
+        return true;
+    }
+
+    int socketFd = -1;
+    pid_t helperPid = -1;
+
+private:
+    [[noreturn]] static void runHelper(const int fd, Counters *counters)
+    {
+        // We go away when the daemon goes away, not on ctrl+c in the terminal
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+
+        // Children are reaped by the kernel
+        signal(SIGCHLD, SIG_IGN);
+
+        char buffer[sizeof(Header) + MaxCommandLength];
+        while (true) {
+            // MSG_TRUNC so we know if it didn't fit
+            const ssize_t ret = recv(fd, buffer, sizeof(buffer), MSG_TRUNC);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                if (ret == -1) perror("Launcher helper failed to read");
+                _exit(0);
+            }
+            // Has to have something after the header, and end with the
+            // terminator of the last argument, or we'd read past the end
+            if (size_t(ret) <= sizeof(Header) || size_t(ret) > sizeof(buffer) || buffer[ret - 1] != '\0') {
+                fprintf(stderr, "Launcher helper got invalid message\n");
+                counters->launchFailures.add();
+                continue;
+            }
+
+            Header header;
+            memcpy(&header, buffer, sizeof(header));
+
+            timespec received;
+            clock_gettime(CLOCK_MONOTONIC, &received);
+
+            // Path first, then the arguments
+            const char *path = nullptr;
+            std::vector<char*> argv;
+            for (char *arg = buffer + sizeof(header); arg < buffer + ret; arg += strlen(arg) + 1) {
+                if (!path) {
+                    path = arg;
+                } else {
+                    argv.push_back(arg);
+                }
+            }
+            if (!path || argv.empty()) {
+                fprintf(stderr, "Launcher helper got invalid command\n");
+                counters->launchFailures.add();
+                continue;
+            }
+            argv.push_back(nullptr);
+
+            if (spawn(path, argv.data()) == -1) {
+                counters->launchFailures.add();
+            } else {
+                counters->launches.add();
+            }
+
+            if (s_verbose) {
+                timespec launched;
+                clock_gettime(CLOCK_MONOTONIC, &launched);
+                printf("Launcher helper: queued %ld us, launched in %ld us\n",
+                        nanosecondsBetween(header.sent, received) / 1000,
+                        nanosecondsBetween(received, launched) / 1000);
+                fflush(stdout);
+            }
+        }
+    }
+
+    static long nanosecondsBetween(const timespec &start, const timespec &end)
+    {
+        return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+    }
+
+    Counters *m_counters = nullptr;
+};
@@ -0,0 +1,447 @@
+#pragma once
+
+#include "backgroundthread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include <stdio.h>
+}
+
+// Logging that never blocks whoever is logging, so -v doesn't change the
+// timing of what we're trying to debug, and a stuck terminal or journald
+// doesn't hold up the keys.
+//
+// logPrint() just copies the format string pointer and the arguments into a
+// fixed size ring, and a separate thread formats and writes them. If the ring
+// is full the record is dropped and counted, instead of waiting. Before the
+// thread is started (and in the benchmarks) it's just printed directly.
+//
+// Strings are copied, and truncated to MaxString, so it's fine to log the
+// filename of something that's about to be closed. The format is checked
+// against the arguments when compiling, like the compiler does for printf().
+struct Log
+{
+    static constexpr uint32_t Size = 256; // records
+    static constexpr size_t PayloadSize = 480;
+    static constexpr size_t MaxString = 127;
+
+    struct Record;
+    using Formatter = int (*)(const Record &record, char *buffer, size_t size);
+
+    struct Record {
+        std::atomic<uint64_t> sequence;
+        Formatter formatter;
+        const char *format;
+        FILE *stream;
+        char payload[PayloadSize];
+    };
+
+    Log()
+    {
+        for (uint32_t i=0; i<Size; i++) {
+            m_records[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Log() { stop(); }
+
+    Log(const Log &) = delete;
+    Log &operator=(const Log &) = delete;
+
+    void start()
+    {
+        m_thread = startBackgroundThread(&Log::run, this);
+        m_running.store(true, std::memory_order_release);
+    }
+
+    // Writes out whatever is left first
+    void stop()
+    {
+        if (!m_running.load(std::memory_order_acquire)) {
+            return;
+        }
+        m_stopping.store(true, std::memory_order_seq_cst);
+        wake();
+        m_thread.join();
+        m_running.store(false, std::memory_order_release);
+    }
+
+    bool isRunning() const { return m_running.load(std::memory_order_acquire); }
+
+    template<typename... Args>
+    void write(FILE *stream, const char *format, const Args &...args)
+    {
+        static_assert((encodedSize<Args>() + ... + 0) <= PayloadSize, "Too much to log in one go");
+
+        if (!isRunning()) {
+            char buffer[PayloadSize + 512];
+            Record record;
+            record.format = format;
+            encodeAll(record.payload, args...);
+            const int length = formatRecord<Args...>(record, buffer, sizeof(buffer));
+            fwrite(buffer, 1, std::min(size_t(std::max(length, 0)), sizeof(buffer) - 1), stream);
+            return;
+        }
+
+        // Multiple producers, every record has a sequence number that says
+        // if it's free for the round we're in (pos), or written (pos + 1).
+        uint64_t pos = m_head.load(std::memory_order_relaxed);
+        Record *record;
+        while (true) {
+            record = &m_records[pos % Size];
+            const uint64_t sequence = record->sequence.load(std::memory_order_acquire);
+            const int64_t diff = int64_t(sequence) - int64_t(pos);
+            if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full, the writer can't keep up
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        record->formatter = &formatRecord<Args...>;
+        record->format = format;
+        record->stream = stream;
+        encodeAll(record->payload, args...);
+        // Pairs with the flusher setting m_waiting before checking the
+        // sequence again, so at least one of us sees the other.
+        record->sequence.store(pos + 1, std::memory_order_seq_cst);
+
+        // Only the first one after it went to sleep wakes it up
+        if (m_waiting.load(std::memory_order_seq_cst) && m_waiting.exchange(false)) {
+            wake();
+        }
+    }
+
+    std::atomic<uint64_t> dropped = 0;
+
+    // The printf format attribute can't see through the templates, and it
+    // wouldn't know that a std::string is fine for %s, so this checks the
+    // format itself. A mismatch fails to compile, with an error about
+    // formatDoesNotMatchArguments().
+    template<typename... Args>
+    struct Format {
+        consteval Format(const char *format) : string(format) { check(); }
+
+        const char *string;
+
+    private:
+        enum class Type { None, String, Signed, Unsigned, Float, Pointer };
+        struct Argument {
+            Type type = Type::None;
+            size_t size = 0;
+            bool promoted = false; // smaller than int, so the sign doesn't matter
+        };
+
+        template<typename T>
+        static constexpr Argument argument()
+        {
+            using U = std::decay_t<T>;
+            if constexpr (isString<T>()) {
+                return { Type::String, 0, false };
+            } else if constexpr (std::is_enum_v<U>) {
+                return argument<std::underlying_type_t<U>>();
+            } else if constexpr (std::is_floating_point_v<U>) {
+                return { Type::Float, std::max(sizeof(U), sizeof(double)), false };
+            } else if constexpr (std::is_pointer_v<U>) {
+                return { Type::Pointer, sizeof(U), false };
+            } else if constexpr (sizeof(U) < sizeof(int)) {
+                return { Type::Signed, sizeof(int), true };
+            } else {
+                return { std::is_signed_v<U> ? Type::Signed : Type::Unsigned, sizeof(U), false };
+            }
+        }
+
+        // Not constexpr, so calling it from check() is what fails
+        static void formatDoesNotMatchArguments() {}
+
+        static constexpr bool isOneOf(const char c, const char *chars)
+        {
+            for (; *chars; chars++) {
+                if (c == *chars) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static constexpr void expectInteger(const Argument &argument, const size_t size, const Type sign)
+        {
+            if (argument.type != Type::Signed && argument.type != Type::Unsigned) {
+                formatDoesNotMatchArguments();
+            }
+            if (argument.size != size) {
+                formatDoesNotMatchArguments();
+            }
+            if (sign != Type::None && !argument.promoted && argument.type != sign) {
+                formatDoesNotMatchArguments();
+            }
+        }
+
+        constexpr void check() const
+        {
+            constexpr size_t count = sizeof...(Args);
+            const Argument arguments[count + 1] = { argument<Args>()..., Argument() };
+            size_t next = 0;
+            const auto take = [&]() -> const Argument & {
+                if (next >= count) {
+                    formatDoesNotMatchArguments();
+                }
+                return arguments[next++];
+            };
+
+            for (const char *c = string; *c; c++) {
+                if (*c != '%') {
+                    continue;
+                }
+                c++;
+                if (*c == '%') {
+                    continue;
+                }
+                while (isOneOf(*c, "-+ #0'")) {
+                    c++;
+                }
+                if (*c == '*') {
+                    expectInteger(take(), sizeof(int), Type::Signed);
+                    c++;
+                }
+                while (*c >= '0' && *c <= '9') {
+                    c++;
+                }
+                if (*c == '.') {
+                    c++;
+                    if (*c == '*') {
+                        expectInteger(take(), sizeof(int), Type::Signed);
+                        c++;
+                    }
+                    while (*c >= '0' && *c <= '9') {
+                        c++;
+                    }
+                }
+
+                size_t size = sizeof(int);
+                bool hasLength = false;
+                bool longDouble = false;
+                if (c[0] == 'h') {
+                    c += c[1] == 'h' ? 2 : 1;
+                    hasLength = true;
+                } else if (c[0] == 'l') {
+                    size = c[1] == 'l' ? sizeof(long long) : sizeof(long);
+                    c += c[1] == 'l' ? 2 : 1;
+                    hasLength = true;
+                } else if (*c == 'z' || *c == 'j' || *c == 't') {
+                    size = *c == 'z' ? sizeof(size_t) : *c == 'j' ? sizeof(intmax_t) : sizeof(ptrdiff_t);
+                    c++;
+                    hasLength = true;
+                } else if (*c == 'L') {
+                    longDouble = true;
+                    c++;
+                }
+
+                if (*c == 'd' || *c == 'i') {
+                    expectInteger(take(), size, Type::Signed);
+                } else if (*c == 'u') {
+                    expectInteger(take(), size, Type::Unsigned);
+                } else if (isOneOf(*c, "xXo")) {
+                    expectInteger(take(), size, Type::None);
+                } else if (*c == 'c' && !hasLength) {
+                    expectInteger(take(), sizeof(int), Type::None);
+                } else if (*c == 's' && !hasLength) {
+                    if (take().type != Type::String) {
+                        formatDoesNotMatchArguments();
+                    }
+                } else if (*c == 'p' && !hasLength) {
+                    if (take().type != Type::Pointer) {
+                        formatDoesNotMatchArguments();
+                    }
+                } else if (isOneOf(*c, "fFeEgGaA") && !hasLength) {
+                    const Argument &value = take();
+                    if (value.type != Type::Float || value.size != (longDouble ? sizeof(long double) : sizeof(double))) {
+                        formatDoesNotMatchArguments();
+                    }
+                } else {
+                    // Including %n, and running off the end
+                    formatDoesNotMatchArguments();
+                }
+                if (longDouble && !isOneOf(*c, "fFeEgGaA")) {
+                    formatDoesNotMatchArguments();
+                }
+            }
+            if (next != count) {
+                formatDoesNotMatchArguments();
+            }
+        }
+    };
+
+private:
+    template<typename T>
+    static constexpr bool isString()
+    {
+        return std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view> ||
+            std::is_same_v<std::decay_t<T>, const char*> || std::is_same_v<std::decay_t<T>, char*>;
+    }
+
+    template<typename T>
+    static constexpr size_t encodedSize()
+    {
+        if constexpr (isString<T>()) {
+            return MaxString + 1;
+        } else {
+            static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>, "Can't log this");
+            return sizeof(T);
+        }
+    }
+
+    // What's passed to snprintf in the end
+    template<typename T>
+    using Decoded = std::conditional_t<isString<T>(), const char*, std::decay_t<T>>;
+
+    static void encodeString(char **pos, const char *string, const size_t length)
+    {
+        const size_t copied = std::min(length, MaxString);
+        memcpy(*pos, string, copied);
+        (*pos)[copied] = '\0';
+        *pos += copied + 1;
+    }
+
+    template<typename T>
+    static void encode(char **pos, const T &value)
+    {
+        if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+            encodeString(pos, value.data(), value.size());
+        } else if constexpr (isString<T>()) {
+            const char *string = value;
+            if (!string) {
+                string = "(null)";
+            }
+            encodeString(pos, string, strlen(string));
+        } else {
+            memcpy(*pos, &value, sizeof(T));
+            *pos += sizeof(T);
+        }
+    }
+
+    template<typename... Args>
+    static void encodeAll(char *payload, const Args &...args)
+    {
+        char *pos = payload;
+        (encode(&pos, args), ...);
+        (void)pos;
+    }
+
+    template<typename T>
+    static Decoded<T> decode(const char **pos)
+    {
+        if constexpr (isString<T>()) {
+            const char *string = *pos;
+            *pos += strlen(string) + 1;
+            return string;
+        } else {
+            T value;
+            memcpy(&value, *pos, sizeof(T));
+            *pos += sizeof(T);
+            return value;
+        }
+    }
+
+    template<typename... Args>
+    static int formatRecord(const Record &record, char *buffer, const size_t size)
+    {
+        if constexpr (sizeof...(Args) == 0) {
+            return snprintf(buffer, size, "%s", record.format);
+        } else {
+            const char *pos = record.payload;
+            // Braced initialization is evaluated left to right
+            const std::tuple<Decoded<Args>...> values { decode<Args>(&pos)... };
+            return std::apply([&](const Decoded<Args> &...decoded) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+                return snprintf(buffer, size, record.format, decoded...);
+#pragma GCC diagnostic pop
+            }, values);
+        }
+    }
+
+    void wake()
+    {
+        m_wakeups.fetch_add(1, std::memory_order_seq_cst);
+        m_wakeups.notify_one();
+    }
+
+    void run()
+    {
+        uint64_t tail = 0;
+        uint64_t reportedDropped = 0;
+        char buffer[PayloadSize + 512];
+        while (true) {
+            Record &record = m_records[tail % Size];
+            if (record.sequence.load(std::memory_order_acquire) == tail + 1) {
+                const int length = record.formatter(record, buffer, sizeof(buffer));
+                FILE *stream = record.stream;
+                record.sequence.store(tail + Size, std::memory_order_release);
+                tail++;
+                fwrite(buffer, 1, std::min(size_t(std::max(length, 0)), sizeof(buffer) - 1), stream);
+                continue;
+            }
+
+            // Caught up, so now is a good time to actually write it out
+            const uint64_t droppedNow = dropped.load(std::memory_order_relaxed);
+            if (droppedNow != reportedDropped) {
+                fprintf(stderr, "[%lu log records dropped]\n", droppedNow - reportedDropped);
+                reportedDropped = droppedNow;
+            }
+            fflush(stdout);
+            fflush(stderr);
+
+            const uint32_t wakeups = m_wakeups.load(std::memory_order_seq_cst);
+            m_waiting.store(true, std::memory_order_seq_cst);
+            if (record.sequence.load(std::memory_order_seq_cst) == tail + 1) {
+                m_waiting.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            if (m_stopping.load(std::memory_order_seq_cst)) {
+                return;
+            }
+            m_wakeups.wait(wakeups);
+            m_waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    Record m_records[Size];
+    alignas(64) std::atomic<uint64_t> m_head = 0;
+    alignas(64) std::atomic<bool> m_waiting = false;
+    std::atomic<uint32_t> m_wakeups = 0;
+    std::atomic<bool> m_stopping = false;
+    std::atomic<bool> m_running = false;
+    std::thread m_thread;
+};
+
+static Log s_log;
+
+// Like printf() to stdout
+template<typename... Args>
+static void logPrint(const Log::Format<std::type_identity_t<Args>...> format, const Args &...args)
+{
+    s_log.write(stdout, format.string, args...);
+}
+
+// Like fprintf() to stderr
+template<typename... Args>
+static void logError(const Log::Format<std::type_identity_t<Args>...> format, const Args &...args)
+{
+    s_log.write(stderr, format.string, args...);
+}
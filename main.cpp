@@ -6,17 +6,34 @@ static bool s_dryRun = false;
 #include "udevconnection.h"
 #include "utils.h"
 #include "keys.h"
+#include "eventloop.h"
+#include "keyset.h"
+#include "command.h"
+#include "shortcuts.h"
+#include "launcher.h"
+#include "configwatcher.h"
+#include "stats.h"
+#include "eventsource.h"
+#include "keyboard.h"
+#include "deviceregistry.h"
+#include "deviceworker.h"
+#include "uringeventloop.h"
+#include "realtime.h"
+#include "controlsocket.h"
+#include "metrics.h"
+#include "config.h"
 
-#include <iostream>
 #include <sstream>
 #include <fstream>
 #include <filesystem>
+#include <memory>
 
 
 extern "C" {
 #include <linux/input.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <wordexp.h>
@@ -24,278 +41,128 @@ extern "C" {
 #include <termios.h>
 }
 
-static bool s_pressedKeys[KEY_CNT];
-static bool s_usedKeys[KEY_CNT];
+// Set on SIGUSR1
+static volatile sig_atomic_t s_dumpStats = false;
 
-struct File
-{
-    File (const std::string &filename, bool keyboard, const int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC) : m_filename(filename) {
-        fd = open(filename.c_str(), flags);
-
-        if (fd == -1) {
-            perror(("Failed to open " + filename).c_str());
-            return;
-        }
-
-        if (keyboard) {
-            long bits[KEY_CNT] = { 0 };
-            int ret = ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits);
-            if (ret < 0) {
-                perror(("Failed to get key bits from " + filename).c_str());
-                close(fd);
-                fd = -1;
-                return;
-            }
-        }
+// If a keyboard has been quiet for this long we ask the kernel what's held
+// down before trusting what we have, instead of waking up periodically.
+static constexpr int64_t s_staleSeconds = 30;
 
-        if (s_verbose) printf("Opened %s\n", m_filename.c_str());
-    }
-
-    ~File() {
-        if (fd != -1) {
-            // Closing is very slow, for some reason, so print progress
-            std::cout << "Closing " << fd << std::flush;
-            close(fd);
-            if (s_verbose) {
-                puts("");
-            } else {
-                std::cout << "\033[2K\r";
-            }
-        }
-    }
-
-    File(File&& other) : m_filename(std::move(other.m_filename)) {
-        fd = other.fd;
-        other.fd = -1;
-    }
-
-    File &operator=(File &&other) {
-        m_filename = std::move(other.m_filename);
-        fd = other.fd;
-        other.fd = -1;
-        return *this;
-    }
-
-    void unlink() {
-        if (unlinkat(fd, m_filename.c_str(), 0) == -1) {
-            perror(("Failed to unlink " + m_filename).c_str());
-        }
-    }
-
-    File(const File &) = delete;
-    File &operator=(const File &) = delete;
-
-    bool isOpen() { return fd != -1; }
-
-    int fd = -1;
-
-    const std::string &filename() const { return m_filename; }
-
-private:
-    std::string m_filename;
-};
+void signalHandler(int sig)
+{
+    signal(sig, SIG_DFL);
+    s_running = false;
+}
 
-static void resetPressedKeys()
+void dumpStatsHandler(int)
 {
-    memset(s_pressedKeys, 0, KEY_CNT * sizeof(bool));
+    // Can't print from here, the main loop does it
+    s_dumpStats = true;
 }
 
-static bool handleKey(const int fd)
+int main(int argc, char *argv[])
 {
-    while (true) {
-        input_event iev;
-        int ret = read(fd, &iev, sizeof(iev));
-        if (ret != sizeof(iev)) {
-            if (errno == EAGAIN) {
-                return true;
-            }
-            if (errno != ENODEV || s_verbose) perror("Short read");
-            return false;
+    bool printKeys = false;
+    bool useLauncherHelper = false;
+    bool showStats = false;
+    bool pipelined = false;
+    bool useIoUring = false;
+    bool realtime = false;
+    int realtimePriority = 0;
+    std::string configPath;
+    std::string tracePath;
+    std::string fakeUdevDirectory;
+    std::string controlRequest;
+    for (int i=1; i<argc; i++) {
+        const std::string arg(argv[i]);
+
+        if (arg == "-p" || arg == "--printkeys") {
+            printKeys = true;
+            continue;
         }
-        if (iev.type == EV_SYN && iev.code == SYN_DROPPED) {
-            fprintf(stderr, "Got dropped events!");
-            return false;
+        if (arg == "--helper") {
+            useLauncherHelper = true;
+            continue;
         }
-        if (iev.type != EV_KEY) {
-            if (s_verbose) printf("Wrong event type %d (%d: %d) ", iev.type, iev.code, iev.value);
-            // Why doesn't it work when I try continue instead here? I feel dumb
-            return true;
+        if (arg == "--stats") {
+            showStats = true;
+            continue;
         }
-        if (s_veryVerbose) printf("Correct event type %d (%d: %d) ", iev.type, iev.code, iev.value);
-        if (iev.code >= KEY_CNT) {
-            printf("Invalid key %d\n", iev.code);
-            return false;
+        if (arg == "--realtime") {
+            realtime = true;
+            continue;
         }
-        s_pressedKeys[iev.code] = iev.value;
-        if (s_verbose) printf("key %s has state %d\n", getKeyName(iev.code).c_str(), iev.value);
-    }
-    return true;
-}
-
-struct Shortcut {
-    std::vector<uint16_t> keys;
-    std::string command;
-    bool active = false;
-    bool isValid() const { return !keys.empty() && !command.empty(); }
-};
-
-std::vector<File> openKeyboards(const std::unordered_map<std::string, std::string> &keyboards)
-{
-    std::vector<File> files;
-    for (const std::pair<const std::string, std::string> &keyboard : keyboards) {
-        if (s_verbose) std::cout << keyboard.first << ": " << keyboard.second << std::endl;
-
-        File file(keyboard.second, true);
-        if (!file.isOpen()) {
+        if (arg == "--realtime-priority" && i + 1 < argc) {
+            realtime = true;
+            realtimePriority = atoi(argv[++i]);
             continue;
         }
-
-
-        files.push_back(std::move(file));
-    }
-    return files;
-}
-
-static std::string getConfigPath()
-{
-    std::string path;
-
-    char *rawPath = getenv("XDG_CONFIG_HOME");
-    if (rawPath) {
-        path = std::string(rawPath);
-    }
-    if (path.empty()) {
-        rawPath = getenv("HOME");
-        if (rawPath) {
-            path = getenv("HOME");
-            path += "/.config";
-        }
-    } else if (path.find(':') != std::string::npos) {
-        std::istringstream stream(path);
-        std::string testPath;
-        while (std::getline(stream, testPath, ':')) {
-            testPath = resolvePath(testPath);
-            if (!std::filesystem::exists(testPath)) {
-                continue;
-            }
-            if (!std::filesystem::is_directory(testPath)) {
-                continue;
-            }
-
-            path = testPath;
-            break;
+        if (arg == "--io-uring") {
+            useIoUring = true;
+            continue;
         }
-    }
-    path += "/shortcut-satan.conf";
-    return resolvePath(path);
-}
-
-static Shortcut parseShortcut(const std::string &line)
-{
-    if (line.empty()) {
-        return {};
-    }
-    if (line[0] == '#') {
-        return {};
-    }
-    std::string name;
-    std::string value;
-
-    size_t splitPos = line.find(':');
-    if (splitPos == std::string::npos) {
-        puts(("Invalid line " + line).c_str());
-        return {};
-    }
-
-    Shortcut shortcut;
-    shortcut.command = std_sux::trim(line.substr(splitPos + 1));
-    if (shortcut.command.empty()) {
-        puts(("Missing command: " + line).c_str());
-        return {};
-    }
-
-    const std::string keys = std_sux::trim(line.substr(0, splitPos));
-    if (keys.empty()) {
-        puts(("Missing keys: " + line).c_str());
-        return {};
-    }
-
-    std::istringstream stream(keys);
-    std::string keyString;
-    while (std::getline(stream, keyString, ' ')) {
-        const int keyCode = getKeyCode(std_sux::trim(keyString));
-        if (keyCode == -1) {
-            puts(("Invalid key " + keyString).c_str());
-            return {};
+        if (arg == "--pipeline") {
+            pipelined = true;
+            continue;
         }
-        shortcut.keys.push_back(keyCode);
-        s_usedKeys[keyCode] = true;
-    }
-    return shortcut;
-}
-
-std::vector<Shortcut> parseConfig(const std::string &path)
-{
-    if (!std::filesystem::exists(path)) {
-        puts((path + " does not exist").c_str());
-        return {};
-    }
-
-    std::ifstream file(path);
-    if (!file.is_open()) {
-        perror(("Failed to open config file" + path).c_str());
-        return {};
-    }
-
-    std::vector<Shortcut> ret;
-    std::string line;
-    while (std::getline(file, line)) {
-        Shortcut shortcut = parseShortcut(std_sux::trim(line));
-        if (!shortcut.isValid()) {
+        if ((arg == "-c" || arg == "--config") && i + 1 < argc) {
+            configPath = resolvePath(argv[++i]);
             continue;
         }
-        ret.push_back(shortcut);
-    }
-
-    return ret;
-}
-
-void signalHandler(int sig)
-{
-    signal(sig, SIG_DFL);
-    s_running = false;
-}
-
-int main(int argc, char *argv[])
-{
-    bool printKeys = false;
-    for (int i=1; i<argc; i++) {
-        const std::string arg(argv[i]);
-
-        if (arg == "-p" || arg == "--printkeys") {
-            printKeys = true;
+        if (arg == "--record" && i + 1 < argc) {
+            tracePath = argv[++i];
+            continue;
+        }
+        if (arg == "--fake-udev" && i + 1 < argc) {
+            fakeUdevDirectory = argv[++i];
             continue;
         }
+        if (arg == "--control" && i + 1 < argc) {
+            // Everything after it is the request
+            for (i++; i<argc; i++) {
+                if (!controlRequest.empty()) {
+                    controlRequest += ' ';
+                }
+                controlRequest += argv[i];
+            }
+            break;
+        }
         if (arg == "-v" || arg == "--verbose") {
             s_verbose = true;
             continue;
         }
         if (arg == "-vv" || arg == "--very-verbose") {
             s_verbose = true;
+            s_veryVerbose = true;
             continue;
         }
         if (arg == "--list-keys") {
             puts("Available keys:");
-            for (const std::pair<const std::string, uint16_t> &key : key_conversion_table) {
-                printf("  %s\n", key.first.c_str());
+            std::vector<std::string_view> names;
+            for (const KeyName &key : key_conversion_table) {
+                names.push_back(key.name);
+            }
+            std::sort(names.begin(), names.end());
+            for (const std::string_view name : names) {
+                printf("  %.*s\n", int(name.size()), name.data());
             }
             exit(0);
         }
-        printf("Usage: %s [--verbose|-v|-vv|--very-verbose|--list-keys|-p|--printkeys]\n", argv[0]);
+        printf("Usage: %s [--verbose|-v|-vv|--very-verbose|--list-keys|-p|--printkeys|--helper|--stats|--pipeline|--io-uring|--realtime|--realtime-priority <1-99>|--config <path>|--record <trace>|--fake-udev <dir>|--control <command>]\n", argv[0]);
         exit(EINVAL);
     }
 
-    File pidfile("/tmp/shortcut-satan.lock", false, O_WRONLY | O_CREAT | O_CREAT);
+    // Testing with fake devices shouldn't get in the way of the real one
+    const std::string runtimeDirectory = fakeUdevDirectory.empty() ? "/tmp" : fakeUdevDirectory;
+    const std::string lockPath = runtimeDirectory + "/shortcut-satan.lock";
+    const std::string controlPath = runtimeDirectory + "/shortcut-satan.sock";
+
+    // Just a client for the one that's running
+    if (!controlRequest.empty()) {
+        return ControlSocket::sendRequest(controlPath, controlRequest);
+    }
+
+    File pidfile(lockPath, false, O_WRONLY | O_CREAT | O_CLOEXEC);
     if (!pidfile.isOpen() || lockf(pidfile.fd, F_TLOCK, 0) == -1) {
         if (errno == EAGAIN || errno == EACCES) {
             puts("Already running");
@@ -319,196 +186,395 @@ int main(int argc, char *argv[])
     signal(SIGTERM, &signalHandler);
     signal(SIGQUIT, &signalHandler);
 
+    signal(SIGUSR1, &dumpStatsHandler);
     signal(SIGHUP, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
-    UdevConnection udevConnection;
+    // Fork it before we have allocated much of anything
+    if (useLauncherHelper) {
+        s_launcher.start();
+    }
+
+    // Before any threads are started, and after the helper is forked so it
+    // doesn't inherit any of it
+    if (realtime) {
+        Realtime::enable(realtimePriority);
+        // Set up now, instead of when launching the first time
+        SpawnSettings::get();
+    }
 
-    const std::string configPath = getConfigPath();
-    std::vector<Shortcut> shortcuts = parseConfig(configPath);
-    for (const Shortcut &s : shortcuts) {
-        for (const uint16_t k : s.keys) {
-            if (s_verbose) printf("Keycode: %d\n", k);
-        }
+    // Nothing else should print on the hot path after this
+    if (s_verbose || printKeys) {
+        s_log.start();
     }
-    if (shortcuts.empty()) {
-        puts(("Failed to load " + configPath).c_str());
+
+    if (configPath.empty()) {
+        configPath = getConfigPath();
+    }
+    std::unique_ptr<ShortcutTable> shortcuts = loadShortcuts(configPath, false);
+    if (!shortcuts) {
+        logPrint("Failed to load %s\n", configPath);
         return ENOENT;
     }
+    ConfigWatcher configWatcher(configPath);
+
+    LiveEventSource liveEventSource;
+    EventSource *eventSource = &liveEventSource;
+    std::unique_ptr<EventLoop> eventLoop;
+    if (useIoUring) {
+        std::unique_ptr<UringEventLoop> uringEventLoop = std::make_unique<UringEventLoop>();
+        if (uringEventLoop->isValid()) {
+            // The events have already been read when it wakes us up
+            eventSource = uringEventLoop.get();
+            eventLoop = std::move(uringEventLoop);
+        } else {
+            logPrint("Falling back to epoll\n");
+        }
+    }
+    if (!eventLoop) {
+        eventLoop = std::make_unique<EpollEventLoop>();
+    }
+    if (!eventLoop->isValid()) {
+        return ENOSYS;
+    }
+
+    std::unique_ptr<TraceRecorder> recorder;
+    if (!tracePath.empty()) {
+        recorder = std::make_unique<TraceRecorder>(eventSource, tracePath);
+        if (!recorder->isValid()) {
+            return EIO;
+        }
+        eventSource = recorder.get();
+        logPrint("Recording events to %s\n", tracePath);
+    }
+
+    // With --printkeys we want to see everything
+    KeySet interestingKeys = printKeys ? KeySet::all() : shortcuts->usedKeys;
+
+    // Skips devices that can't send any of the keys we use
+    UdevConnection udevConnection(interestingKeys, fakeUdevDirectory);
 
-    std::vector<File> files = openKeyboards(udevConnection.keyboardPaths);
-    if (files.empty()) {
-        fprintf(stderr, "Failed to open any keyboards\n");
+    // Opened synchronously at startup, there's nothing to hold up yet
+    DeviceRegistry keyboards;
+    for (const UdevConnection::Device &device : udevConnection.rescan()) {
+        if (s_verbose) logPrint("%s: %s\n", device.devpath, device.path);
+        openKeyboard(device.path, device.devpath, interestingKeys, &keyboards, eventLoop.get(), shortcuts.get());
+    }
+    if (keyboards.empty()) {
+        logError("Failed to open any keyboards\n");
         return ENODEV;
     }
 
-    s_running = true;
-    bool anyActiveShortcuts = false;
-    puts("Running");
+    // Everything after startup is opened and closed on another thread
+    DeviceWorker deviceWorker;
+    if (!deviceWorker.isValid()) {
+        return ENOSYS;
+    }
+    eventLoop->add(deviceWorker.notifyFd);
 
-    fd_set fdset;
-    while (s_running) {
-        FD_ZERO(&fdset);
-        int maxFd = 3;
-        for (const File &file : files) {
-            FD_SET(file.fd, &fdset);
-            maxFd = std::max(maxFd, file.fd);
+    if (udevConnection.udevSocketFd != -1) {
+        eventLoop->add(udevConnection.udevSocketFd);
+    }
+    if (configWatcher.isValid()) {
+        eventLoop->add(configWatcher.fd);
+    }
+
+    // Works without it, it's just for scripts
+    ControlSocket controlSocket(controlPath);
+    if (controlSocket.isValid()) {
+        eventLoop->add(controlSocket.fd);
+    }
+
+    // Opens what udev knows about and we don't have, and closes what's gone,
+    // e. g. if we missed something. Returns how many, for the control socket.
+    const auto rescanKeyboards = [&](const bool closeMissing) -> std::pair<int, int> {
+        const std::vector<UdevConnection::Device> devices = udevConnection.rescan();
+        int opening = 0;
+        int closing = 0;
+        if (closeMissing) {
+            keyboards.forEach([&](File *keyboard) {
+                for (const UdevConnection::Device &device : devices) {
+                    if (device.devpath == keyboard->devpath) {
+                        return;
+                    }
+                }
+                if (s_verbose) logPrint("%s is gone, closing\n", keyboard->filename());
+                closeKeyboard(keyboard, &keyboards, eventLoop.get(), &deviceWorker, shortcuts.get());
+                closing++;
+            });
+        }
+        for (const UdevConnection::Device &device : devices) {
+            if (!keyboards.findDevpath(device.devpath) && !deviceWorker.isOpening(device.devpath)) {
+                deviceWorker.open(device.path, device.devpath, interestingKeys);
+                opening++;
+            }
         }
-        FD_SET(udevConnection.udevSocketFd, &fdset);
-        maxFd = std::max(maxFd, udevConnection.udevSocketFd);
+        return { opening, closing };
+    };
+
+    // Requests from the control socket, the reply is sent back as is
+    const auto handleControl = [&](const std::string &request) -> std::string {
+        std::istringstream stream(request);
+        std::string command;
+        std::string argument;
+        stream >> command;
+        std::getline(stream >> std::ws, argument);
+
+        if (command == "devices") {
+            std::string reply;
+            keyboards.forEach([&](File *keyboard) {
+                reply += std::to_string(keyboard->id) + " " + keyboard->filename() + " " + keyboard->devpath + "\n";
+            });
+            return reply;
+        }
+        if (command == "shortcuts") {
+            std::string reply;
+            for (size_t i=0; i<shortcuts->shortcuts.size(); i++) {
+                const Shortcut &shortcut = shortcuts->shortcuts[i];
+                reply += std::to_string(i) + (shortcuts->isEnabled(i) ? " enabled " : " disabled ");
+                reply += shortcutKeys(shortcut) + ": " + shortcut.command.text + "\n";
+            }
+            return reply;
+        }
+        if (command == "enable" || command == "disable" || command == "trigger") {
+            const std::vector<size_t> found = findShortcuts(*shortcuts, argument);
+            if (found.empty()) {
+                return "Error: no shortcut matching '" + argument + "'\n";
+            }
+            for (const size_t index : found) {
+                if (command == "trigger") {
+                    const Command &shortcutCommand = shortcuts->shortcuts[index].command;
+                    if (pipelined) {
+                        s_pipeline.trigger(&shortcutCommand);
+                    } else {
+                        launchCommand(shortcutCommand, 0, monotonicNanoseconds());
+                    }
+                } else {
+                    shortcuts->setEnabled(index, command == "enable");
+                }
+            }
+            const std::string done = command == "trigger" ? "Triggered " : command == "enable" ? "Enabled " : "Disabled ";
+            return done + std::to_string(found.size()) + (found.size() == 1 ? " shortcut\n" : " shortcuts\n");
+        }
+        if (command == "metrics") {
+            return Metrics::format(&keyboards, *shortcuts);
+        }
+        if (command == "rescan") {
+            const std::pair<int, int> result = rescanKeyboards(true);
+            return "Opening " + std::to_string(result.first) + ", closing " + std::to_string(result.second) + "\n";
+        }
+        if (command == "help") {
+            return "devices, shortcuts, enable <shortcut>, disable <shortcut>, trigger <shortcut>, rescan, metrics\n"
+                "<shortcut> is the number from shortcuts, the keys or the command\n";
+        }
+        return "Error: unknown command '" + command + "', try help\n";
+    };
+
+    // Started after the initial resync, the state is ours until now
+    if (pipelined) {
+        s_pipeline.start(shortcuts.get(), printKeys);
+    }
 
-        timeval timeout;
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
+    s_running = true;
+    logPrint("Running\n");
 
-        const int events = select(maxFd + 1, &fdset, 0, 0, &timeout);
+    while (s_running) {
+        // No timeout, we only wake up when something happens
+        const int events = eventLoop->wait(-1);
+        s_wakeups.total++;
+        if (s_dumpStats) {
+            s_dumpStats = false;
+            printStats();
+            if (pipelined) s_pipeline.printStats();
+        }
         if (events == -1) {
-            if (s_running) {
-                perror("Failed during select");
+            if (errno == EINTR) {
+                s_wakeups.interrupted++;
+                continue;
             }
+            perror("Failed waiting for events");
             break;
         }
 
         if (events == 0) {
-            // If there was a timeout, assume we might have missed some events and reset state
-            resetPressedKeys();
+            // Shouldn't happen without a timeout
+            s_wakeups.timeout++;
             continue;
         }
-        if (s_verbose) printf("Handling %d events\n", events);
+        if (s_verbose) logPrint("Handling %d events\n", events);
 
         bool updated = false;
-        bool needReload = false;
-        for (std::vector<File>::iterator it = files.begin(); it != files.end();) {
-            if (!FD_ISSET(it->fd, &fdset)) {
-                it++;
+        bool udevUpdated = false;
+        bool configUpdated = false;
+        bool keyboardsOpened = false;
+        bool controlUpdated = false;
+        for (int i=0; i<events; i++) {
+            const int fd = eventLoop->readyFds[i];
+            if (fd == udevConnection.udevSocketFd) {
+                s_wakeups.udev++;
+                udevUpdated = true;
                 continue;
             }
-            updated = true;
-            if (s_verbose) printf("%s got updated\n", it->filename().c_str());
-
-            bool removed = false;
-            if (!handleKey(it->fd)) {
-                if (errno == ENODEV) {
-                    removed = true;
-                    if (s_verbose) printf("\n%s gone, removing", it->filename().c_str());
-                }
-                if (s_verbose) puts("\nUnable to handle key, resetting state");
-                // Reset pressed keys in case of an error
-                resetPressedKeys();
+            if (fd == configWatcher.fd) {
+                s_wakeups.config++;
+                configUpdated = true;
+                continue;
             }
-            if (s_verbose) puts("");
+            if (fd == deviceWorker.notifyFd) {
+                s_wakeups.opened++;
+                keyboardsOpened = true;
+                continue;
+            }
+            if (fd == controlSocket.fd || controlSocket.isClient(fd)) {
+                s_wakeups.control++;
+                controlUpdated = true;
+                continue;
+            }
+            File *keyboard = keyboards.findFd(fd);
+            if (!keyboard) {
+                // Removed earlier in this round
+                continue;
+            }
+            s_wakeups.keyboard++;
+            updated = true;
+            if (s_verbose) logPrint("%s got updated\n", keyboard->filename());
 
-            if (removed) {
-                it = files.erase(it);
-            } else {
-                it++;
+            // We might have missed something while it was quiet (suspend
+            // etc.), so check before handling the new events.
+            const int64_t now = secondsSinceBoot();
+            if (now - keyboard->lastRead >= s_staleSeconds) {
+                resyncKeys(keyboard, shortcuts.get());
             }
-        }
+            keyboard->lastRead = now;
 
-        // Tiny performance improvement, if the key isn't used in any shortcut
-        // don't loop through all shortcuts
-        bool needToCheckShortcuts = anyActiveShortcuts;// In case there are active shortcuts they need to be updated in case they are inactive
-        if (!anyActiveShortcuts && updated) {
-            for (size_t i = 0; i<KEY_CNT; i++) {
-                if (!s_usedKeys[i]) {
-                    continue;
-                }
-                if (!s_pressedKeys[i]) {
-                    continue;
+            if (!handleKey(keyboard, shortcuts.get(), eventSource)) {
+                if (errno == ENODEV) {
+                    if (s_verbose) logPrint("\n%s gone, removing", keyboard->filename());
+                    closeKeyboard(keyboard, &keyboards, eventLoop.get(), &deviceWorker, shortcuts.get());
+                } else {
+                    if (s_verbose) logPrint("\nUnable to handle key, resyncing\n");
+                    // Only this keyboard, the others are fine
+                    resyncKeys(keyboard, shortcuts.get());
                 }
-
-                needToCheckShortcuts = true;
-                break;
             }
+            if (s_verbose) logPrint("\n");
         }
 
-        if (s_veryVerbose) {
-            if (anyActiveShortcuts) {
-                puts("Has active shortcuts");
-            } else {
-                puts("No active shortcuts");
-            }
-
-            if (!needToCheckShortcuts) {
-                puts("Interesting keys pressed");
-            } else {
-                puts("No interesting keys pressed");
-            }
+        // The matcher does it with --pipeline
+        if (printKeys && updated && !pipelined) {
+            printPressedKeys();
         }
-        if (needToCheckShortcuts) {
-            if (s_veryVerbose) puts("Checking shortcuts");
-            anyActiveShortcuts = false;
-            for (Shortcut &shortcut : shortcuts) {
-                bool activated = true;
-                for (const uint16_t code : shortcut.keys) {
-                    if (!s_pressedKeys[code]) {
-                        if (s_veryVerbose) printf("%d missing\n", code);
-                        activated = false;
-                        break;
-                    }
-                }
-                if (!activated) {
-                    shortcut.active = false;
-                    continue;
+
+        // Done after all the key events, so it doesn't delay them
+        if (configUpdated && configWatcher.hasChanged()) {
+            std::unique_ptr<ShortcutTable> newShortcuts = loadShortcuts(configPath, true);
+            if (newShortcuts) {
+                newShortcuts->copyEnabled(*shortcuts);
+                if (!printKeys) {
+                    interestingKeys = newShortcuts->usedKeys;
+
+                    // Close the ones that are useless now, and forget about
+                    // keys we won't hear about being released anymore.
+                    // Happens with the old shortcuts, so nothing triggers.
+                    keyboards.forEach([&](File *keyboard) {
+                        if (!keyboard->keyBits.intersects(interestingKeys)) {
+                            if (s_verbose) logPrint("%s can't send any of the keys we use, closing\n", keyboard->filename());
+                            closeKeyboard(keyboard, &keyboards, eventLoop.get(), &deviceWorker, shortcuts.get());
+                            return;
+                        }
+                        KeySet keys = keyboard->pressedKeys;
+                        keys.intersect(interestingKeys);
+                        setKeys(keyboard, keys, shortcuts.get());
+                        keyboard->setKeyMask(interestingKeys);
+                    });
                 }
-                if (shortcut.active) {
-                    anyActiveShortcuts = true;
-                    continue;
+
+                // Keep what's held down, but don't trigger anything just
+                // because the config changed
+                if (pipelined) {
+                    s_pipeline.setShortcuts(newShortcuts.get(), std::move(shortcuts));
+                } else {
+                    newShortcuts->setPressed(s_pressedKeys);
                 }
-                shortcut.active = true;
-                anyActiveShortcuts = true;
-                if (s_verbose) printf("Activated '%s'\n", shortcut.command.c_str());
-                launch(shortcut.command);
-            }
+                shortcuts = std::move(newShortcuts);
 
-            if (printKeys) {
-                printf("\033[2K\r");
-                for (int i=0; i<KEY_CNT; i++) {
-                    if (s_pressedKeys[i]) {
-                        printf("'%s' ", getKeyName(i).c_str());
-                    }
+                if (!printKeys) {
+                    // And open the ones that might be useful now
+                    udevConnection.interestingKeys = interestingKeys;
+                    rescanKeyboards(false);
                 }
-                fflush(stdout);
+                logPrint("Reloaded %s, %lu shortcuts\n", configPath, shortcuts->shortcuts.size());
+            } else {
+                logPrint("Failed to reload %s, keeping current shortcuts\n", configPath);
             }
         }
 
-        if (FD_ISSET(udevConnection.udevSocketFd, &fdset)) {
-            std::string updatedPath;
-            const UdevConnection::UpdateResult result = udevConnection.update(&updatedPath);
+        // Read everything that's queued, with io_uring we're only woken up
+        // once for a whole burst
+        while (udevUpdated) {
+            UdevConnection::Device device;
+            const UdevConnection::UpdateResult result = udevConnection.update(&device);
             switch(result) {
-            case UdevConnection::KeyboardAdded: {
-                File file(updatedPath, true);
-                if (!file.isOpen()) {
+            case UdevConnection::KeyboardAdded:
+                if (keyboards.findDevpath(device.devpath) || deviceWorker.isOpening(device.devpath)) {
+                    if (s_veryVerbose) logPrint("%s already added\n", device.path);
                     break;
                 }
-                if (s_verbose) printf("%s added\n", updatedPath.c_str());
-                files.push_back(std::move(file));
+                if (s_verbose) logPrint("%s added, opening\n", device.path);
+                deviceWorker.open(device.path, device.devpath, interestingKeys);
                 break;
-            }
-            case UdevConnection::KeyboardRemoved:
-                for (std::vector<File>::iterator it = files.begin(); it != files.end(); it++) {
-                    if (it->filename() == updatedPath) {
-                        if (s_verbose) printf("%s removed, removing\n", it->filename().c_str());
-                        // Assume there's just one? Neh.
-                        it = files.erase(it);
-                        break;
-                    }
+            case UdevConnection::KeyboardRemoved: {
+                // In case it's removed before we're done opening it
+                deviceWorker.cancelOpen(device.devpath);
+                File *keyboard = keyboards.findDevpath(device.devpath);
+                if (!keyboard && device.devnum != 0) {
+                    keyboard = keyboards.findDevnum(device.devnum);
+                }
+                if (keyboard) {
+                    if (s_verbose) logPrint("%s removed, removing\n", keyboard->filename());
+                    closeKeyboard(keyboard, &keyboards, eventLoop.get(), &deviceWorker, shortcuts.get());
                 }
                 break;
+            }
             case UdevConnection::NoUpdate:
+                udevUpdated = false;
+                break;
+            case UdevConnection::Ignored:
             default:
                 break;
             }
+        }
 
-            needReload = true;
+        if (keyboardsOpened) {
+            for (File &file : deviceWorker.takeOpened()) {
+                // The config might have changed while it was being opened
+                if (!file.keyBits.intersects(interestingKeys)) {
+                    if (s_verbose) logPrint("%s can't send any of the keys we use, closing\n", file.filename());
+                    deviceWorker.close(std::move(file));
+                    continue;
+                }
+                if (!addKeyboard(std::move(file), interestingKeys, &keyboards, eventLoop.get(), shortcuts.get())) {
+                    deviceWorker.close(std::move(file));
+                }
+            }
         }
 
-        if (needReload) {
-            // Reset pressed keys if the keyboard numbers etc. change
-            resetPressedKeys();
+        // Last, whoever is asking can wait a bit
+        if (controlUpdated) {
+            controlSocket.update(eventLoop.get(), handleControl);
         }
     }
-    puts("\nGoodbye");
+    // Let it finish what's queued up
+    s_pipeline.stop();
+    s_log.stop();
+
+    if (showStats) {
+        printStats();
+        if (pipelined) s_pipeline.printStats();
+    } else {
+        printWakeups();
+    }
+    puts("Goodbye");
     pidfile.unlink();
 
     if (printKeys) {
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "stats.h"
+#include "deviceregistry.h"
+#include "shortcuts.h"
+#include "log.h"
+#include "keystate.h"
+
+#include <string>
+
+extern "C" {
+#include <stdio.h>
+}
+
+// The counters and latencies in the Prometheus text format, for the
+// "metrics" control command. Everything is counted as it happens anyway, this
+// just reads it, so it's only done when someone asks.
+struct Metrics
+{
+    static std::string format(DeviceRegistry *keyboards, const ShortcutTable &shortcuts)
+    {
+        Metrics metrics;
+        metrics.counter("events_read_total", "Input events read from keyboards", s_counters.eventsRead.get());
+
+        metrics.header("device_events_read_total", "counter", "Input events read, per open keyboard");
+        keyboards->forEach([&](File *keyboard) {
+            metrics.sample("device_events_read_total", "device", keyboard->filename(), keyboard->eventsRead);
+        });
+
+        metrics.counter("non_key_events_total", "Events that weren't key events and were skipped", s_counters.nonKeyEvents.get());
+        metrics.counter("dropped_events_total", "SYN_DROPPED from the kernel, events were lost", s_counters.droppedEvents.get());
+        metrics.counter("resyncs_total", "Times the pressed keys were read from the kernel", s_wakeups.resyncs);
+        metrics.counter("activations_total", "Shortcuts activated by key presses", s_counters.activations.get());
+        metrics.counter("launches_total", "Commands launched successfully", s_counters.launches.get() + s_launcher.launches());
+        metrics.counter("launch_failures_total", "Commands that failed to launch", s_counters.launchFailures.get() + s_launcher.launchFailures());
+        metrics.counter("log_dropped_total", "Log lines dropped because output couldn't keep up", s_log.dropped.load(std::memory_order_relaxed));
+
+        metrics.header("wakeups_total", "counter", "Times the main loop woke up, by reason");
+        metrics.sample("wakeups_total", "reason", "keyboard", s_wakeups.keyboard);
+        metrics.sample("wakeups_total", "reason", "udev", s_wakeups.udev);
+        metrics.sample("wakeups_total", "reason", "config", s_wakeups.config);
+        metrics.sample("wakeups_total", "reason", "opened", s_wakeups.opened);
+        metrics.sample("wakeups_total", "reason", "control", s_wakeups.control);
+        metrics.sample("wakeups_total", "reason", "interrupted", s_wakeups.interrupted);
+
+        metrics.gauge("open_devices", "Keyboards that are open", keyboards->size());
+        metrics.gauge("shortcuts", "Shortcuts in the config", shortcuts.shortcuts.size());
+
+        metrics.header("latency_seconds", "summary", "Time from a key press until the command is launched, by stage");
+        metrics.summary("kernel_to_read", s_latency.kernel);
+        metrics.summary("read_to_match", s_latency.match);
+        metrics.summary("match_to_launch", s_latency.launch);
+        metrics.summary("kernel_to_launch", s_latency.total);
+        return metrics.m_text;
+    }
+
+private:
+    void header(const char *name, const char *type, const char *help)
+    {
+        m_text += std::string("# HELP shortcut_satan_") + name + " " + help + "\n";
+        m_text += std::string("# TYPE shortcut_satan_") + name + " " + type + "\n";
+    }
+
+    void counter(const char *name, const char *help, const uint64_t value)
+    {
+        header(name, "counter", help);
+        m_text += std::string("shortcut_satan_") + name + " " + std::to_string(value) + "\n";
+    }
+
+    void gauge(const char *name, const char *help, const uint64_t value)
+    {
+        header(name, "gauge", help);
+        m_text += std::string("shortcut_satan_") + name + " " + std::to_string(value) + "\n";
+    }
+
+    void sample(const char *name, const char *label, const std::string &labelValue, const uint64_t value)
+    {
+        m_text += std::string("shortcut_satan_") + name + "{" + label + "=\"" + escape(labelValue) + "\"} " + std::to_string(value) + "\n";
+    }
+
+    // Nanoseconds in the histograms, seconds in Prometheus
+    void summary(const char *stage, const Histogram &histogram)
+    {
+        static constexpr double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        char line[256];
+        for (const double quantile : quantiles) {
+            snprintf(line, sizeof(line), "shortcut_satan_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                    stage, quantile, histogram.percentile(quantile * 100) / 1e9);
+            m_text += line;
+        }
+        snprintf(line, sizeof(line), "shortcut_satan_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+                stage, histogram.sum.load(std::memory_order_relaxed) / 1e9);
+        m_text += line;
+        snprintf(line, sizeof(line), "shortcut_satan_latency_seconds_count{stage=\"%s\"} %lu\n",
+                stage, histogram.count.load(std::memory_order_relaxed));
+        m_text += line;
+    }
+
+    static std::string escape(const std::string &value)
+    {
+        std::string ret;
+        for (const char c : value) {
+            if (c == '\\' || c == '"') {
+                ret += '\\';
+            } else if (c == '\n') {
+                ret += "\\n";
+                continue;
+            }
+            ret += c;
+        }
+        return ret;
+    }
+
+    std::string m_text;
+};
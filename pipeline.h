@@ -0,0 +1,226 @@
+#pragma once
+
+#include "spscring.h"
+#include "keystate.h"
+#include "shortcuts.h"
+#include "histogram.h"
+#include "stats.h"
+#include "backgroundthread.h"
+
+#include <memory>
+#include <thread>
+
+extern "C" {
+#include <stdio.h>
+}
+
+// Time spent waiting in the queues between the stages, in nanoseconds
+static struct {
+    Histogram match; // read -> the matcher got it
+    Histogram launch; // activated -> the launcher got it
+} s_queueLatency;
+
+// With --pipeline reading, matching and launching happen on separate
+// threads, so a slow fork or a blocked terminal doesn't hold up reading the
+// next events:
+//
+//   main loop (reads the keyboards, udev etc.)
+//     -> key events -> matcher thread (owns the key state and shortcuts)
+//     -> commands -> launcher thread
+//
+// The main loop still keeps track of what's held down on each keyboard, so
+// only actual changes are sent on. Nothing is allocated once it's running,
+// and the old shortcuts are freed by the launcher after a reload.
+struct Pipeline
+{
+    Pipeline() = default;
+    ~Pipeline() { stop(); }
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    void start(ShortcutTable *shortcuts, const bool printKeys)
+    {
+        m_shortcuts = shortcuts;
+        m_printKeys = printKeys;
+
+        m_matcher = startBackgroundThread(&Pipeline::runMatcher, this);
+        m_launcher = startBackgroundThread(&Pipeline::runLauncher, this);
+
+        m_running = true;
+        if (s_verbose) logPrint("Started pipeline\n");
+    }
+
+    // Finishes whatever is queued first
+    void stop()
+    {
+        if (!m_running) {
+            return;
+        }
+        KeyEvent event = {};
+        event.type = KeyEvent::Stop;
+        m_keyEvents.push(event);
+        m_matcher.join();
+        m_launcher.join();
+        m_running = false;
+    }
+
+    bool isRunning() const { return m_running; }
+
+    // From the main loop, times like s_eventTime and s_readTime
+    void setKey(const uint16_t code, const bool pressed, const int64_t eventTime, const int64_t readTime)
+    {
+        KeyEvent event;
+        event.type = KeyEvent::Key;
+        event.code = code;
+        event.pressed = pressed;
+        event.eventTime = eventTime;
+        event.readTime = readTime;
+        event.shortcuts = nullptr;
+        m_keyEvents.push(event);
+    }
+
+    // From the main loop, doesn't wait. old is what was passed to start() or
+    // the last call, the matcher hands it on to the launcher which deletes it
+    // after launching everything that was queued before, since those point
+    // into it.
+    void setShortcuts(ShortcutTable *shortcuts, std::unique_ptr<ShortcutTable> old)
+    {
+        KeyEvent event = {};
+        event.type = KeyEvent::Shortcuts;
+        event.shortcuts = shortcuts;
+        m_keyEvents.push(event);
+
+        // The matcher still has it as m_shortcuts
+        old.release();
+    }
+
+    // From the main loop, launches it as if the shortcut was pressed
+    void trigger(const Command *command)
+    {
+        KeyEvent event = {};
+        event.type = KeyEvent::Trigger;
+        event.command = command;
+        m_keyEvents.push(event);
+    }
+
+    void printStats() const
+    {
+        s_queueLatency.match.print("queued for match");
+        s_queueLatency.launch.print("queued for launch");
+        printf("Queues: key events max %u deep, %lu stalls; launches max %u deep, %lu stalls\n",
+                m_keyEvents.maxDepth.load(), m_keyEvents.stalls.load(),
+                m_launches.maxDepth.load(), m_launches.stalls.load());
+    }
+
+private:
+    struct KeyEvent {
+        enum Type : uint8_t {
+            Key,
+            Shortcuts, // new shortcuts after a reload
+            Trigger, // from the control socket
+            Stop
+        };
+        Type type;
+        bool pressed;
+        uint16_t code;
+        int64_t eventTime;
+        int64_t readTime;
+        union {
+            ShortcutTable *shortcuts;
+            const Command *command;
+        };
+    };
+
+    struct Launch {
+        const Command *command; // null to stop, unless oldShortcuts is set
+        ShortcutTable *oldShortcuts; // to delete, nothing to launch
+        int64_t eventTime;
+        int64_t matched;
+    };
+
+    void runMatcher()
+    {
+        KeyEvent event;
+        while (true) {
+            m_keyEvents.pop(&event);
+
+            switch(event.type) {
+            case KeyEvent::Key: {
+                s_queueLatency.match.record(monotonicNanoseconds() - event.readTime);
+                setPressed(event.code, event.pressed, m_shortcuts, [&](const Shortcut &shortcut) {
+                    Launch launch;
+                    launch.command = &shortcut.command;
+                    launch.oldShortcuts = nullptr;
+                    launch.eventTime = event.eventTime;
+                    launch.matched = monotonicNanoseconds();
+                    s_latency.match.record(launch.matched - event.readTime);
+                    s_counters.activations.add();
+                    m_launches.push(launch);
+                });
+                // Only when we've caught up, the terminal can be slow
+                if (m_printKeys && m_keyEvents.size() == 0) {
+                    printPressedKeys();
+                }
+                break;
+            }
+            case KeyEvent::Shortcuts: {
+                // Keep what's held down, but don't trigger anything just
+                // because the config changed
+                event.shortcuts->setPressed(s_pressedKeys);
+                Launch launch = {};
+                launch.oldShortcuts = m_shortcuts;
+                m_launches.push(launch);
+                m_shortcuts = event.shortcuts;
+                break;
+            }
+            case KeyEvent::Trigger: {
+                Launch launch;
+                launch.command = event.command;
+                launch.oldShortcuts = nullptr;
+                launch.eventTime = 0;
+                launch.matched = monotonicNanoseconds();
+                m_launches.push(launch);
+                break;
+            }
+            case KeyEvent::Stop: {
+                Launch launch = {};
+                m_launches.push(launch);
+                return;
+            }
+            }
+        }
+    }
+
+    void runLauncher()
+    {
+        Launch launch;
+        while (true) {
+            m_launches.pop(&launch);
+            if (launch.oldShortcuts) {
+                // Only after a reload, so it's fine to free here
+                delete launch.oldShortcuts;
+                continue;
+            }
+            if (!launch.command) {
+                return;
+            }
+            const int64_t now = monotonicNanoseconds();
+            s_queueLatency.launch.record(now - launch.matched);
+            launchCommand(*launch.command, launch.eventTime, now);
+        }
+    }
+
+    SpscRing<KeyEvent, 4096> m_keyEvents;
+    SpscRing<Launch, 256> m_launches;
+
+    std::thread m_matcher;
+    std::thread m_launcher;
+    bool m_running = false;
+
+    // Only used by the matcher once it's started
+    ShortcutTable *m_shortcuts = nullptr;
+    bool m_printKeys = false;
+};
+
+static Pipeline s_pipeline;
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstring>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+}
+
+// For --realtime, so we don't get paged out and take hundreds of milliseconds
+// to react to a key press when the machine is busy.
+//
+// Should be done before any threads are started, everything that's already
+// mapped gets faulted in, and that includes the whole stack of every thread.
+struct Realtime
+{
+    // Enough for what we do on the stack when handling events, and some heap
+    // for whatever gets allocated later (config reloads, new keyboards).
+    static constexpr size_t StackReserve = 256 * 1024;
+    static constexpr size_t HeapReserve = 4 * 1024 * 1024;
+
+    // priority is for SCHED_FIFO, 0 to keep the normal scheduling
+    static bool enable(const int priority)
+    {
+        // Keep what's freed, both so it stays locked and so we don't need to
+        // fault in new pages for every allocation.
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+        prefaultHeap();
+        prefaultStack();
+
+        // With a limit, locking everything in the future would make
+        // allocations fail when we hit it, instead of just being slow.
+        rlimit limit;
+        const bool unlimited = geteuid() == 0 || (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur == RLIM_INFINITY);
+
+        bool ret = true;
+        if (mlockall(MCL_CURRENT) == -1) {
+            perror("Failed to lock memory");
+            ret = false;
+        } else if (!unlimited) {
+            puts("RLIMIT_MEMLOCK is set, only locking what we have now");
+        } else if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1) {
+            // Only lock new things when they're used, otherwise every thread
+            // gets its whole 8 MB stack locked.
+            if (errno != EINVAL || mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+                perror("Failed to lock future memory");
+                ret = false;
+            }
+        }
+
+        if (priority > 0) {
+            sched_param param = {};
+            param.sched_priority = priority;
+            // Whatever we launch shouldn't be real time
+            if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == -1) {
+                perror("Failed to set real time priority");
+                ret = false;
+            }
+        }
+        if (s_verbose) printf("Real time mode enabled, priority %d\n", priority);
+        return ret;
+    }
+
+private:
+    static void prefaultHeap()
+    {
+        char *reserve = static_cast<char*>(malloc(HeapReserve));
+        if (!reserve) {
+            return;
+        }
+        memset(reserve, 0, HeapReserve);
+        free(reserve);
+    }
+
+    // Not inlined, so the array actually ends up on the stack
+    __attribute__((noinline)) static void prefaultStack()
+    {
+        char stack[StackReserve];
+        memset(stack, 0, sizeof(stack));
+        // Or the compiler figures out it's pointless
+        asm volatile("" : : "r"(stack) : "memory");
+    }
+};
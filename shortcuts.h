@@ -0,0 +1,224 @@
+#pragma once
+
+#include "keyset.h"
+#include "command.h"
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+struct Shortcut {
+    std::vector<uint16_t> keys;
+    Command command;
+    bool isValid() const { return !keys.empty() && command.isValid(); }
+};
+
+// The shortcuts compiled for matching.
+//
+// Only keys that are used by some shortcut get a bit, numbered densely, so
+// with less than 64 distinct keys in the config (which is basically always)
+// every shortcut mask is a single word.
+//
+// For every key we also keep a list of the shortcuts containing it, and for
+// every shortcut how many of its keys are currently pressed, so a key press
+// or release only touches the shortcuts that actually contain that key
+// instead of checking all of them.
+struct ShortcutTable
+{
+    static constexpr uint16_t Unused = 0xffff;
+
+    explicit ShortcutTable(std::vector<Shortcut> list) : shortcuts(std::move(list))
+    {
+        std::fill(std::begin(keyIndex), std::end(keyIndex), Unused);
+
+        uint16_t keyCount = 0;
+        for (const Shortcut &shortcut : shortcuts) {
+            for (const uint16_t code : shortcut.keys) {
+                if (keyIndex[code] != Unused) {
+                    continue;
+                }
+                keyIndex[code] = keyCount++;
+                usedKeys.set(code);
+            }
+        }
+
+        stride = std::max((keyCount + 63) / 64, 1);
+        masks.resize(shortcuts.size() * stride);
+        for (size_t i=0; i<shortcuts.size(); i++) {
+            uint64_t *mask = &masks[i * stride];
+            for (const uint16_t code : shortcuts[i].keys) {
+                mask[keyIndex[code] / 64] |= KeySet::bit(keyIndex[code]);
+            }
+        }
+
+        // Build the key -> shortcuts index from the masks, so duplicate keys
+        // in a shortcut are only counted once.
+        keyShortcutsStart.resize(keyCount + 1);
+        keyCounts.resize(shortcuts.size());
+        for (size_t i=0; i<shortcuts.size(); i++) {
+            forEachKey(i, [&](const uint16_t index) {
+                keyShortcutsStart[index + 1]++;
+                keyCounts[i]++;
+            });
+        }
+        for (size_t index=0; index<keyCount; index++) {
+            keyShortcutsStart[index + 1] += keyShortcutsStart[index];
+        }
+        keyShortcuts.resize(keyShortcutsStart[keyCount]);
+        std::vector<uint32_t> fill(keyShortcutsStart.begin(), keyShortcutsStart.end() - 1);
+        for (size_t i=0; i<shortcuts.size(); i++) {
+            forEachKey(i, [&](const uint16_t index) {
+                keyShortcuts[fill[index]++] = i;
+            });
+        }
+
+        pressed.resize(stride);
+        pressedCounts.resize(shortcuts.size());
+        active.resize(shortcuts.size());
+        disabled = std::make_unique<std::atomic<bool>[]>(shortcuts.size());
+    }
+
+    bool isUsed(const uint16_t code) const { return usedKeys.test(code); }
+
+    // Updates the state of the key, and calls onActivated for every shortcut
+    // that became active because of it.
+    template<typename Func>
+    void setKey(const uint16_t code, const bool isPressed, Func &&onActivated)
+    {
+        const uint16_t index = keyIndex[code];
+        if (index == Unused) {
+            return;
+        }
+        const bool wasPressed = pressed[index / 64] & KeySet::bit(index);
+        if (wasPressed == isPressed) {
+            // Autorepeat, or a release we already handled
+            return;
+        }
+
+        const uint32_t *begin = keyShortcuts.data() + keyShortcutsStart[index];
+        const uint32_t *end = keyShortcuts.data() + keyShortcutsStart[index + 1];
+        if (isPressed) {
+            pressed[index / 64] |= KeySet::bit(index);
+            for (const uint32_t *it = begin; it != end; it++) {
+                if (++pressedCounts[*it] != keyCounts[*it]) {
+                    continue;
+                }
+                active[*it] = true;
+                activeCount++;
+                if (!disabled[*it].load(std::memory_order_relaxed)) {
+                    onActivated(shortcuts[*it]);
+                }
+            }
+        } else {
+            pressed[index / 64] &= ~KeySet::bit(index);
+            for (const uint32_t *it = begin; it != end; it++) {
+                if (pressedCounts[*it]-- != keyCounts[*it]) {
+                    continue;
+                }
+                active[*it] = false;
+                activeCount--;
+            }
+        }
+    }
+
+    void clear()
+    {
+        std::fill(pressed.begin(), pressed.end(), 0);
+        std::fill(pressedCounts.begin(), pressedCounts.end(), 0);
+        std::fill(active.begin(), active.end(), false);
+        activeCount = 0;
+    }
+
+    // Sets the state of all keys at once, e. g. when the table is new. It
+    // doesn't activate anything, shortcuts that are already held down only
+    // activate again when one of the keys is pressed again.
+    void setPressed(const KeySet &keys)
+    {
+        clear();
+        keys.forEach([this](const uint16_t code) {
+            const uint16_t index = keyIndex[code];
+            if (index != Unused) {
+                pressed[index / 64] |= KeySet::bit(index);
+            }
+        });
+
+        for (size_t i=0; i<shortcuts.size(); i++) {
+            uint16_t count = 0;
+            for (size_t word=0; word<stride; word++) {
+                count += __builtin_popcountll(masks[i * stride + word] & pressed[word]);
+            }
+            pressedCounts[i] = count;
+            active[i] = count == keyCounts[i];
+            activeCount += active[i];
+        }
+    }
+
+    // If any of the keys we care about are pressed
+    bool anyPressed() const
+    {
+        uint64_t ret = 0;
+        for (const uint64_t word : pressed) {
+            ret |= word;
+        }
+        return ret != 0;
+    }
+
+    bool anyActive() const { return activeCount > 0; }
+
+    // Disabled shortcuts are still tracked, they just don't launch anything.
+    // Can be changed from the main loop while the matcher is running.
+    bool isEnabled(const size_t index) const { return !disabled[index].load(std::memory_order_relaxed); }
+    void setEnabled(const size_t index, const bool enabled) { disabled[index].store(!enabled, std::memory_order_relaxed); }
+
+    // So a config reload doesn't enable everything again
+    void copyEnabled(const ShortcutTable &other)
+    {
+        for (size_t i=0; i<shortcuts.size(); i++) {
+            for (size_t j=0; j<other.shortcuts.size(); j++) {
+                if (!other.isEnabled(j) && shortcuts[i].keys == other.shortcuts[j].keys && shortcuts[i].command.text == other.shortcuts[j].command.text) {
+                    setEnabled(i, false);
+                }
+            }
+        }
+    }
+
+    std::vector<Shortcut> shortcuts;
+    KeySet usedKeys;
+
+    // Key code -> bit in the masks, Unused if not in any shortcut
+    uint16_t keyIndex[KEY_CNT];
+
+    // Words per shortcut
+    size_t stride = 1;
+    std::vector<uint64_t> masks;
+
+    // Shortcuts containing key bit n are in keyShortcuts, from
+    // keyShortcutsStart[n] up to keyShortcutsStart[n + 1]
+    std::vector<uint32_t> keyShortcutsStart;
+    std::vector<uint32_t> keyShortcuts;
+
+    // Number of distinct keys in each shortcut, and how many are pressed
+    std::vector<uint16_t> keyCounts;
+    std::vector<uint16_t> pressedCounts;
+
+    std::vector<uint64_t> pressed;
+    std::vector<uint8_t> active;
+    size_t activeCount = 0;
+
+    std::unique_ptr<std::atomic<bool>[]> disabled;
+
+private:
+    template<typename Func>
+    void forEachKey(const size_t shortcut, Func &&func) const
+    {
+        for (size_t word=0; word<stride; word++) {
+            uint64_t bits = masks[shortcut * stride + word];
+            while (bits) {
+                func(uint16_t(word * 64 + __builtin_ctzll(bits)));
+                bits &= bits - 1;
+            }
+        }
+    }
+};
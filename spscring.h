@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <thread>
+
+// Fixed size queue between exactly one producer thread and one consumer
+// thread. No locks, and nothing is allocated after it's created.
+//
+// Either side can block when there's nothing to do (consumer) or no space
+// (producer), the other side only pays for a notify when someone is actually
+// waiting.
+template<typename T, uint32_t Size>
+struct SpscRing
+{
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+    SpscRing() = default;
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    // Producer, returns false if it's full
+    bool tryPush(const T &item)
+    {
+        const uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tailCache == Size) {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head - m_tailCache == Size) {
+                return false;
+            }
+        }
+        m_items[head % Size] = item;
+
+        // Pairs with the consumer setting m_consumerWaiting before checking
+        // if it's empty, so at least one of us sees the other.
+        // Only the first one after it went to sleep wakes it up
+        m_head.store(head + 1, std::memory_order_seq_cst);
+        if (m_consumerWaiting.load(std::memory_order_seq_cst) && m_consumerWaiting.exchange(false)) {
+            m_head.notify_one();
+        }
+
+        const uint32_t depth = head + 1 - m_tail.load(std::memory_order_relaxed);
+        if (depth > maxDepth.load(std::memory_order_relaxed)) {
+            maxDepth.store(depth, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Producer, waits until there's space
+    void push(const T &item)
+    {
+        if (tryPush(item)) {
+            return;
+        }
+        stalls.fetch_add(1, std::memory_order_relaxed);
+        while (!tryPush(item)) {
+            m_producerWaiting.store(true, std::memory_order_seq_cst);
+            const uint32_t tail = m_tail.load(std::memory_order_seq_cst);
+            if (m_head.load(std::memory_order_relaxed) - tail == Size) {
+                m_tail.wait(tail);
+            }
+            m_producerWaiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Consumer, returns false if it's empty
+    bool tryPop(T *item)
+    {
+        const uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_headCache) {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail == m_headCache) {
+                return false;
+            }
+        }
+        *item = m_items[tail % Size];
+
+        // Let it fill up half of it in one go, instead of waking it up
+        // for every single free slot
+        m_tail.store(tail + 1, std::memory_order_seq_cst);
+        if (m_producerWaiting.load(std::memory_order_seq_cst) && m_headCache - (tail + 1) <= Size / 2 && m_producerWaiting.exchange(false)) {
+            m_tail.notify_one();
+        }
+        return true;
+    }
+
+    // Consumer, waits until there's something. Spins for a bit first, when
+    // things are busy the next one is usually right behind and going to sleep
+    // and being woken up costs a lot more. Unless there's only one CPU, then
+    // we'd just be in the way of the producer.
+    void pop(T *item)
+    {
+        static const int spinCount = std::thread::hardware_concurrency() > 1 ? SpinCount : 0;
+        for (int i=0; i<spinCount; i++) {
+            if (tryPop(item)) {
+                return;
+            }
+            cpuRelax();
+        }
+        while (!tryPop(item)) {
+            m_consumerWaiting.store(true, std::memory_order_seq_cst);
+            const uint32_t head = m_head.load(std::memory_order_seq_cst);
+            if (head == m_tail.load(std::memory_order_relaxed)) {
+                m_head.wait(head);
+            }
+            m_consumerWaiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // Only approximate, the other side might be busy
+    uint32_t size() const
+    {
+        return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed);
+    }
+
+    // How full it has been, and how often the producer had to wait
+    std::atomic<uint32_t> maxDepth = 0;
+    std::atomic<uint64_t> stalls = 0;
+
+private:
+    static constexpr int SpinCount = 2000;
+
+    static void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Keep the two sides on separate cache lines, so they don't bounce
+    // between the cores for every item.
+    alignas(64) std::atomic<uint32_t> m_head = 0;
+    uint32_t m_tailCache = 0; // producer's idea of m_tail
+    std::atomic<bool> m_producerWaiting = false;
+
+    alignas(64) std::atomic<uint32_t> m_tail = 0;
+    uint32_t m_headCache = 0; // consumer's idea of m_head
+    std::atomic<bool> m_consumerWaiting = false;
+
+    alignas(64) T m_items[Size];
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "histogram.h"
+
+#include <atomic>
+#include <cstdint>
+
+extern "C" {
+#include <time.h>
+#include <stdio.h>
+}
+
+// Why we woke up, to make sure we don't when idle
+static struct {
+    uint64_t total = 0;
+    uint64_t keyboard = 0;
+    uint64_t udev = 0;
+    uint64_t config = 0;
+    uint64_t opened = 0; // the device worker is done opening something
+    uint64_t control = 0;
+    uint64_t timeout = 0;
+    uint64_t interrupted = 0;
+    uint64_t resyncs = 0;
+} s_wakeups;
+
+// Counts something that's only changed by one thread at a time, but can be
+// read from anywhere. A plain add, not a locked one, so it's basically free.
+struct Counter
+{
+    void add(const uint64_t count = 1) { value.store(value.load(std::memory_order_relaxed) + count, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    std::atomic<uint64_t> value = 0;
+};
+
+// What happened to the events and shortcuts, for the metrics
+static struct {
+    Counter eventsRead;
+    Counter nonKeyEvents; // MSC_SCAN, LEDs etc. that we skip
+    Counter droppedEvents; // SYN_DROPPED from the kernel
+    Counter activations; // only the ones from key presses
+    Counter launches; // that worked, including triggered from the control socket
+    Counter launchFailures; // the launcher helper has its own for both
+} s_counters;
+
+// How long it takes from pressing a key until the command is launched, in
+// nanoseconds, split up so we can see who's slow.
+static struct {
+    Histogram kernel; // kernel timestamp -> we read it
+    Histogram match; // read -> shortcut activated
+    Histogram launch; // activated -> launch() returned
+    Histogram total; // kernel timestamp -> launch() returned
+} s_latency;
+
+// When the key event currently being handled happened and when we read it.
+// The kernel time is 0 if we don't know, e. g. when resyncing.
+static int64_t s_eventTime = 0;
+static int64_t s_readTime = 0;
+
+static int64_t monotonicNanoseconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void printWakeups()
+{
+    printf("\nWoke up %lu times: keyboard %lu, udev %lu, config %lu, opened %lu, control %lu, timeout %lu, interrupted %lu; %lu resyncs\n",
+            s_wakeups.total, s_wakeups.keyboard, s_wakeups.udev, s_wakeups.config, s_wakeups.opened, s_wakeups.control,
+            s_wakeups.timeout, s_wakeups.interrupted, s_wakeups.resyncs);
+}
+
+[[maybe_unused]] static void printStats()
+{
+    printWakeups();
+    s_latency.kernel.print("kernel -> read");
+    s_latency.match.print("read -> match");
+    s_latency.launch.print("match -> launch");
+    s_latency.total.print("kernel -> launch");
+    fflush(stdout);
+}
@@ -3,9 +3,15 @@
 #include <string>
 #include <algorithm>
 #include <filesystem>
+#include <vector>
 
 extern "C" {
 #include <libudev.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,21 +20,41 @@ extern "C" {
 
 #include "onreturn.h"
 #include "utils.h"
+#include "keyset.h"
 
+// Finds keyboards, and tells us when they come and go.
+//
+// For testing it can also run against a fake directory instead of udev: the
+// keyboards are the fifos named event* in it, and uevents are datagrams sent
+// to the socket "uevents" in it, like "add <path>" or "remove <path>".
 struct UdevConnection {
-    UdevConnection()
+    struct Device {
+        std::string devpath;
+        std::string path; // in /dev
+        dev_t devnum = 0;
+    };
+
+    // Devices that can't send any of interestingKeys are skipped
+    UdevConnection(const KeySet &keys, const std::string &fakeDir = {}) :
+        interestingKeys(keys),
+        fakeDirectory(fakeDir)
     {
+        if (!fakeDirectory.empty()) {
+            startFake();
+            return;
+        }
+
         context = udev_new();
 
         if (!context) {
-            fprintf(stderr, "Failed to connect to udev\n");
+            logError("Failed to connect to udev\n");
             return;
         }
 
         udevMonitor = udev_monitor_new_from_netlink(context, "udev");
 
         if (!udevMonitor) {
-            fprintf(stderr, "Failed to create udev monitor\n");
+            logError("Failed to create udev monitor\n");
             return;
         }
 
@@ -36,8 +62,6 @@ struct UdevConnection {
         udev_monitor_enable_receiving(udevMonitor);
         udevSocketFd = udev_monitor_get_fd(udevMonitor);
         udevAvailable = true;
-
-        init();
     }
 
     static std::string devicePath(udev_device *dev)
@@ -47,7 +71,7 @@ struct UdevConnection {
         if (!sysName.empty()) {
             linkPath = sysName;
         } else {
-            if (s_verbose) puts("Falling back");
+            if (s_verbose) logPrint("Falling back\n");
             udev_list_entry *devLink= udev_device_get_devlinks_list_entry(dev);
             if (!devLink) {
                 return {};
@@ -56,7 +80,44 @@ struct UdevConnection {
         }
         return linkPath;
     }
-    std::string addKeyboard(udev_device *dev)
+    // Reads the key bitmap of the input device from sysfs, so we don't need
+    // to open the device to find out. Returns false if we can't tell.
+    static bool keyCapabilities(udev_device *dev, KeySet *keys)
+    {
+        udev_device *inputDevice = udev_device_get_parent_with_subsystem_devtype(dev, "input", nullptr);
+        if (!inputDevice) {
+            return false;
+        }
+        const char *bits = udev_device_get_sysattr_value(inputDevice, "capabilities/key");
+        if (!bits) {
+            return false;
+        }
+
+        // Space separated hex longs, most significant first
+        std::vector<unsigned long> words;
+        char *end = nullptr;
+        for (const char *word = bits; *word; word = end) {
+            words.push_back(strtoul(word, &end, 16));
+            if (end == word) {
+                return false;
+            }
+        }
+
+        keys->clear();
+        const size_t bitsPerWord = sizeof(unsigned long) * 8;
+        for (size_t i=0; i<words.size(); i++) {
+            const unsigned long word = words[words.size() - 1 - i];
+            for (size_t bit=0; bit<bitsPerWord; bit++) {
+                if ((word & (1UL << bit)) && i * bitsPerWord + bit < KEY_CNT) {
+                    keys->set(i * bitsPerWord + bit);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Returns an empty path if it's not a keyboard we can use
+    Device keyboardDevice(udev_device *dev)
     {
         const std::string id = udev_device_get_devpath(dev);
 
@@ -64,40 +125,47 @@ struct UdevConnection {
         const std::string isKey = std_sux::string(udev_device_get_property_value(dev, "ID_INPUT_KEY"));
 
         if (isKeyboard != "1" && isKey != "1") {
-            if (s_verbose) fprintf(stderr, "!!!!!!!! Skipping non-keyboard %s\n", id.c_str());
+            if (s_verbose) logError("!!!!!!!! Skipping non-keyboard %s\n", id);
             if (s_veryVerbose) printProperties(dev);
-            if (s_verbose) fprintf(stderr, " -------------\n");
-            return "";
+            if (s_verbose) logError(" -------------\n");
+            return {};
         }
 
         // It's a list entry, but we only need one
         std::string linkPath = devicePath(dev);
         if (linkPath.empty() || !std::filesystem::exists(linkPath)) {
-            if (s_verbose) fprintf(stderr, "Skipping device not in /dev: %s (%s)\n", id.c_str(), linkPath.c_str());
+            if (s_verbose) logError("Skipping device not in /dev: %s (%s)\n", id, linkPath);
             if (s_veryVerbose) printProperties(dev);
-            return "";
+            return {};
         }
 
         // Not initialized yet
         if (!udev_device_get_is_initialized(dev)) {
-            if (s_verbose) printf("%s not initialized yet\n", linkPath.c_str());
-            return "";
+            if (s_verbose) logPrint("%s not initialized yet\n", linkPath);
+            return {};
         }
 
 
-        if (keyboardPaths.count(id) != 0) {
-            if (s_verbose) printf("%s already added\n", linkPath.c_str());
-            return "";
+        KeySet capabilities;
+        if (keyCapabilities(dev, &capabilities) && !capabilities.intersects(interestingKeys)) {
+            if (s_verbose) logPrint("Skipping %s, it can't send any of the keys we use\n", linkPath);
+            return {};
         }
 
-        if (s_verbose) fprintf(stdout, "Found keyboard: %s: %s\n", id.c_str(), linkPath.c_str());
+        if (s_veryVerbose) logPrint("Found keyboard: %s: %s\n", id, linkPath);
         if (s_veryVerbose) printProperties(dev);
-        keyboardPaths[id] = linkPath;
-        return linkPath;
+        return { id, linkPath, udev_device_get_devnum(dev) };
     }
 
-    void init()
+    // Finds all the keyboards, including the ones we already have open
+    std::vector<Device> rescan()
     {
+        if (!fakeDirectory.empty()) {
+            return rescanFake();
+        }
+
+        std::vector<Device> found;
+
         udev_enumerate *enumerate = udev_enumerate_new(context);
 
         udev_enumerate_add_match_subsystem(enumerate, "input");
@@ -110,27 +178,36 @@ struct UdevConnection {
             const char *path = udev_list_entry_get_name(entry);
 
             if (!path) {
-                fprintf(stderr, "Invalid device when listing\n");
+                logError("Invalid device when listing\n");
                 continue;
             }
 
             udev_device *dev = udev_device_new_from_syspath(context, path);
 
             if (!dev) {
-                fprintf(stderr, "failed getting %s\n", path);
+                logError("failed getting %s\n", path);
                 continue;
             }
-            addKeyboard(dev);
+            Device device = keyboardDevice(dev);
+            if (!device.path.empty()) {
+                found.push_back(std::move(device));
+            }
 
             udev_device_unref(dev);
         }
 
         udev_enumerate_unref(enumerate);
-        if (s_verbose) printf("Got %ld keyboards\n", keyboardPaths.size());
+        if (s_verbose) logPrint("Got %zu keyboards\n", found.size());
+        return found;
     }
 
     ~UdevConnection()
     {
+        if (!fakeDirectory.empty() && udevSocketFd != -1) {
+            close(udevSocketFd);
+            unlink((fakeDirectory + "/uevents").c_str());
+        }
+
         if (udevMonitor) {
             udev_monitor_unref(udevMonitor);
         }
@@ -142,31 +219,42 @@ struct UdevConnection {
 
     void printProperties(udev_device *dev)
     {
-        fprintf(stderr, "sysname: %s\n", udev_device_get_sysname(dev));
+        logError("sysname: %s\n", udev_device_get_sysname(dev));
         udev_list_entry *entry = udev_device_get_properties_list_entry(dev);
 
         while (entry) {
             const char *name = udev_list_entry_get_name(entry);
             const char *value = udev_list_entry_get_value(entry);
-            fprintf(stderr, "property name: %s value %s\n", name, value);
+            logError("property name: %s value %s\n", name, value);
             entry = udev_list_entry_get_next(entry);
         }
     }
 
     enum UpdateResult {
-        NoUpdate,
+        NoUpdate, // nothing left to read
+        Ignored, // not something we care about
         KeyboardAdded,
         KeyboardRemoved
     };
 
-    UpdateResult update(std::string *keyboardPath)
+    // Handles one message, call until it returns NoUpdate to get all of them.
+    // When a keyboard is removed only the devpath and devnum are set, and it
+    // might not be one we have open.
+    UpdateResult update(Device *device)
     {
         if (!udevAvailable) {
-            fprintf(stderr, "udev unavailable\n");
+            logError("udev unavailable\n");
             return NoUpdate;
         }
+        if (!fakeDirectory.empty()) {
+            return updateFake(device);
+        }
 
         udev_device *dev = udev_monitor_receive_device(udevMonitor);
+        if (!dev) {
+            // Nothing there after all
+            return NoUpdate;
+        }
         OnReturn releaseDev([&]() {
             udev_device_unref(dev);
         });
@@ -174,21 +262,17 @@ struct UdevConnection {
         const std::string id = udev_device_get_devpath(dev);
 
         const std::string action = udev_device_get_action(dev);
-        if (s_verbose) printf("udev action: %s for id %s\n", action.c_str(), id.c_str());
+        if (s_verbose) logPrint("udev action: %s for id %s\n", action, id);
         if (action == "remove" || action == "offline") {
-            if (!keyboardPaths.contains(id)) {
-                return NoUpdate;
-            }
-            *keyboardPath = keyboardPaths[id];
-            keyboardPaths.erase(id);
+            device->devpath = id;
+            device->devnum = udev_device_get_devnum(dev);
             return KeyboardRemoved;
         }
-        std::string path = addKeyboard(dev);
-        if (!path.empty()) {
-            *keyboardPath = path;
+        *device = keyboardDevice(dev);
+        if (!device->path.empty()) {
             return KeyboardAdded;
         }
-        return NoUpdate;
+        return Ignored;
     }
 
     udev *context = nullptr;
@@ -198,6 +282,98 @@ struct UdevConnection {
 
     int udevSocketFd = -1;
 
-    std::unordered_map<std::string, std::string> keyboardPaths;
+    KeySet interestingKeys;
+
+    // If set we don't use udev at all
+    const std::string fakeDirectory;
+
+private:
+    void startFake()
+    {
+        const std::string socketPath = fakeDirectory + "/uevents";
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            logError("Fake udev path too long: %s\n", socketPath);
+            return;
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+
+        udevSocketFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (udevSocketFd == -1) {
+            perror("Failed to create fake udev socket");
+            return;
+        }
+        unlink(socketPath.c_str());
+        if (bind(udevSocketFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+            perror(("Failed to bind " + socketPath).c_str());
+            close(udevSocketFd);
+            udevSocketFd = -1;
+            return;
+        }
+        udevAvailable = true;
+        logPrint("Using fake udev in %s\n", fakeDirectory);
+    }
+
+    // The path is the devpath as well, there's no device number
+    Device fakeKeyboardDevice(const std::string &path)
+    {
+        std::error_code error;
+        if (!std::filesystem::is_fifo(path, error)) {
+            if (s_verbose) logError("Skipping %s, not a fifo\n", path);
+            return {};
+        }
+        if (s_veryVerbose) logPrint("Found fake keyboard: %s\n", path);
+        return { path, path, 0 };
+    }
+
+    std::vector<Device> rescanFake()
+    {
+        std::vector<Device> found;
+        std::error_code error;
+        for (const std::filesystem::directory_entry &entry : std::filesystem::directory_iterator(fakeDirectory, error)) {
+            if (!entry.path().filename().string().starts_with("event")) {
+                continue;
+            }
+            Device device = fakeKeyboardDevice(entry.path());
+            if (!device.path.empty()) {
+                found.push_back(std::move(device));
+            }
+        }
+        if (error) {
+            logError("Failed to list %s: %s\n", fakeDirectory, error.message());
+        }
+        return found;
+    }
+
+    UpdateResult updateFake(Device *device)
+    {
+        char buffer[PATH_MAX + 16];
+        const ssize_t ret = recv(udevSocketFd, buffer, sizeof(buffer) - 1, 0);
+        if (ret <= 0) {
+            if (ret == -1 && errno != EAGAIN) perror("Failed to read fake uevent");
+            return NoUpdate;
+        }
+        buffer[ret] = '\0';
+
+        const char *separator = strchr(buffer, ' ');
+        if (!separator) {
+            logError("Invalid fake uevent: %s\n", buffer);
+            return Ignored;
+        }
+        const std::string action(buffer, separator - buffer);
+        const std::string path(separator + 1);
+        if (s_verbose) logPrint("fake udev action: %s for %s\n", action, path);
+
+        if (action == "remove") {
+            device->devpath = path;
+            return KeyboardRemoved;
+        }
+        if (action != "add") {
+            return Ignored;
+        }
+        *device = fakeKeyboardDevice(path);
+        return device->path.empty() ? Ignored : KeyboardAdded;
+    }
 };
 
@@ -0,0 +1,503 @@
+#pragma once
+
+#include "eventloop.h"
+#include "eventsource.h"
+#include "log.h"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <linux/input.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+}
+
+// Event loop on top of io_uring, without liburing so we don't pull in another
+// dependency for a couple of syscalls.
+//
+// Instead of being told that a keyboard is readable and then reading from it
+// ourselves, we always have a read posted on every keyboard, and the events
+// are already there when wait() returns. Submitting the next reads and
+// getting the completed ones is a single io_uring_enter(), or none at all if
+// something already completed. The first few keyboards read into registered
+// buffers, so the kernel doesn't have to map them for every read.
+//
+// Everything else (udev, inotify, eventfds) just gets a multishot poll.
+//
+// It's also the EventSource for the keyboards, read() gives back what the
+// last completed read got.
+struct UringEventLoop : EventLoop, EventSource
+{
+    static constexpr unsigned QueueSize = 256;
+    static constexpr size_t BufferEvents = 64;
+    static constexpr size_t BufferSize = BufferEvents * sizeof(input_event);
+    static constexpr size_t FixedBuffers = 64;
+
+    UringEventLoop()
+    {
+        io_uring_params params = {};
+        ringFd = syscall(__NR_io_uring_setup, QueueSize, &params);
+        if (ringFd == -1) {
+            perror("Failed to set up io_uring");
+            return;
+        }
+        if (!(params.features & IORING_FEAT_NODROP)) {
+            // We'd lose completions if the queue overflows
+            fprintf(stderr, "io_uring is too old\n");
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+        if (params.features & IORING_FEAT_CQE_SKIP) {
+            m_skipSuccess = IOSQE_CQE_SKIP_SUCCESS;
+        }
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        }
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) {
+            perror("Failed to map io_uring submission queue");
+            m_sqRing = nullptr;
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cqRing = m_sqRing;
+        } else {
+            m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED) {
+                perror("Failed to map io_uring completion queue");
+                m_cqRing = nullptr;
+                return;
+            }
+        }
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            perror("Failed to map io_uring submission entries");
+            return;
+        }
+        m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+        char *sq = static_cast<char*>(m_sqRing);
+        m_sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        m_sqEntries = params.sq_entries;
+        uint32_t *array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        for (uint32_t i=0; i<m_sqEntries; i++) {
+            array[i] = i;
+        }
+
+        char *cq = static_cast<char*>(m_cqRing);
+        m_cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        m_canWaitWithTimeout = params.features & IORING_FEAT_EXT_ARG;
+
+        // Counts against RLIMIT_MEMLOCK, so not a lot, and it works without
+        m_fixedBuffers = static_cast<input_event*>(mmap(nullptr, FixedBuffers * BufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0));
+        if (m_fixedBuffers == MAP_FAILED) {
+            m_fixedBuffers = nullptr;
+        } else {
+            const iovec buffers = { m_fixedBuffers, FixedBuffers * BufferSize };
+            if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, &buffers, 1) == -1) {
+                if (s_verbose) perror("Failed to register buffers for io_uring, using normal reads");
+                munmap(m_fixedBuffers, FixedBuffers * BufferSize);
+                m_fixedBuffers = nullptr;
+            }
+        }
+    }
+
+    ~UringEventLoop()
+    {
+        if (ringFd != -1) {
+            close(ringFd);
+        }
+        if (m_sqes) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if (m_cqRing && m_cqRing != m_sqRing) {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        if (m_sqRing) {
+            munmap(m_sqRing, m_sqRingSize);
+        }
+        if (m_fixedBuffers) {
+            munmap(m_fixedBuffers, FixedBuffers * BufferSize);
+        }
+    }
+
+    bool isValid() const override { return m_sqes != nullptr; }
+
+    bool add(const int fd) override
+    {
+        fdState(fd).polled = true;
+        armPoll(fd);
+        return true;
+    }
+
+    bool addDevice(const int fd) override
+    {
+        uint32_t slot;
+        if (!m_freeSlots.empty()) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else {
+            slot = m_slots.size();
+            m_slots.emplace_back();
+            if (slot < FixedBuffers && m_fixedBuffers) {
+                m_slots[slot].buffer = m_fixedBuffers + slot * BufferEvents;
+            } else {
+                m_slots[slot].ownBuffer = std::make_unique<input_event[]>(BufferEvents);
+                m_slots[slot].buffer = m_slots[slot].ownBuffer.get();
+            }
+        }
+        Slot &device = m_slots[slot];
+        device.fd = fd;
+        device.result = 0;
+        device.consumed = 0;
+        fdState(fd).slot = slot;
+        armRead(slot);
+        return true;
+    }
+
+    void remove(const int fd) override
+    {
+        if (size_t(fd) >= m_fds.size()) {
+            return;
+        }
+        FdState &state = m_fds[fd];
+        if (state.polled) {
+            state.polled = false;
+            cancel(IORING_OP_POLL_REMOVE, userData(Poll, fd));
+        }
+        if (state.slot != NoSlot) {
+            Slot &device = m_slots[state.slot];
+            device.fd = -1;
+            if (device.pending) {
+                // The buffer can't be reused until the kernel is done with it,
+                // the slot is freed when the read comes back cancelled.
+                cancel(IORING_OP_ASYNC_CANCEL, userData(DevicePoll, state.slot));
+                cancel(IORING_OP_ASYNC_CANCEL, userData(DeviceRead, state.slot));
+            } else {
+                m_freeSlots.push_back(state.slot);
+            }
+            state.slot = NoSlot;
+        }
+    }
+
+    int wait(const int timeoutMs) override
+    {
+        m_round++;
+
+        // Whatever we handed out last time has been handled now
+        for (const uint32_t slot : m_delivered) {
+            // Might have been removed, or even reused for something new
+            if (m_slots[slot].fd != -1 && !m_slots[slot].pending) {
+                armRead(slot);
+            }
+        }
+        m_delivered.clear();
+
+        while (true) {
+            int count = reap();
+            if (count > 0) {
+                // Still need to submit the new reads
+                if (unsubmitted() && enter(0, 0, nullptr) == -1 && errno != EINTR) {
+                    return -1;
+                }
+                return count;
+            }
+            if (timeoutMs == 0) {
+                return enter(0, 0, nullptr) == -1 ? -1 : reap();
+            }
+
+            timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+            if (enter(1, IORING_ENTER_GETEVENTS, timeoutMs > 0 ? &timeout : nullptr) == -1) {
+                if (errno == ETIME) {
+                    return reap();
+                }
+                return -1;
+            }
+            count = reap();
+            // Could have been only bookkeeping, like cancellations
+            if (count > 0 || timeoutMs > 0) {
+                return count;
+            }
+        }
+    }
+
+    // Gives back what the last completed read on the keyboard got
+    ssize_t read(const int fd, const uint32_t, input_event *events, const size_t count) override
+    {
+        if (size_t(fd) >= m_fds.size() || m_fds[fd].slot == NoSlot) {
+            errno = EBADF;
+            return -1;
+        }
+        Slot &device = m_slots[m_fds[fd].slot];
+        if (device.pending || device.failed) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (device.result <= 0 || device.result % sizeof(input_event) != 0) {
+            // Only reported once, like a real read
+            device.failed = true;
+            if (device.result < 0) {
+                errno = -device.result;
+            } else if (device.result == 0) {
+                // Only fifos (fake keyboards) do this, when the other end is gone
+                errno = ENODEV;
+            } else {
+                logError("Short read (%d bytes)\n", device.result);
+                errno = EIO;
+            }
+            return -1;
+        }
+        const size_t available = device.result / sizeof(input_event) - device.consumed;
+        if (available == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        const size_t ret = std::min(available, count);
+        memcpy(events, device.buffer + device.consumed, ret * sizeof(input_event));
+        device.consumed += ret;
+        return ret;
+    }
+
+    int ringFd = -1;
+
+private:
+    static constexpr uint32_t NoSlot = 0xffffffff;
+
+    // What the completions are for
+    enum Type : uint8_t {
+        Poll, // index is the fd
+        DevicePoll, // index is the slot, linked with DeviceRead
+        DeviceRead,
+        Cancel
+    };
+    static uint64_t userData(const Type type, const uint32_t index) { return uint64_t(type) << 32 | index; }
+
+    struct Slot {
+        int fd = -1;
+        bool pending = false; // read in flight
+        bool failed = false; // the error has been reported
+        int32_t result = 0; // bytes, or -errno
+        uint32_t consumed = 0; // events
+        input_event *buffer = nullptr;
+        std::unique_ptr<input_event[]> ownBuffer;
+    };
+
+    struct FdState {
+        bool polled = false;
+        uint32_t slot = NoSlot;
+        uint64_t reportedRound = 0;
+    };
+
+    FdState &fdState(const int fd)
+    {
+        if (size_t(fd) >= m_fds.size()) {
+            m_fds.resize(fd + 1);
+        }
+        return m_fds[fd];
+    }
+
+    uint32_t unsubmitted() const
+    {
+        return m_sqTailLocal - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    }
+
+    // Makes sure there's room for count entries, so linked ones aren't split
+    // up between two submissions.
+    void reserve(const uint32_t count)
+    {
+        if (m_sqEntries - unsubmitted() < count) {
+            enter(0, 0, nullptr);
+        }
+    }
+
+    io_uring_sqe *nextSqe()
+    {
+        io_uring_sqe *sqe = &m_sqes[m_sqTailLocal & m_sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        m_sqTailLocal++;
+        return sqe;
+    }
+
+    int enter(const unsigned minComplete, unsigned flags, timespec *timeout)
+    {
+        __atomic_store_n(m_sqTail, m_sqTailLocal, __ATOMIC_RELEASE);
+
+        io_uring_getevents_arg arg = {};
+        const void *argp = nullptr;
+        size_t argSize = 0;
+        if (timeout && m_canWaitWithTimeout) {
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uintptr_t>(timeout);
+            argp = &arg;
+            argSize = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+        return syscall(__NR_io_uring_enter, ringFd, unsubmitted(), minComplete, flags, argp, argSize);
+    }
+
+    void armPoll(const int fd)
+    {
+        reserve(1);
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = userData(Poll, fd);
+    }
+
+    // Waits for it to be readable first, the keyboards are non blocking and
+    // a plain read would just fail with EAGAIN.
+    void armRead(const uint32_t slot)
+    {
+        Slot &device = m_slots[slot];
+        device.pending = true;
+        device.failed = false;
+        device.result = 0;
+        device.consumed = 0;
+
+        reserve(2);
+        io_uring_sqe *poll = nextSqe();
+        poll->opcode = IORING_OP_POLL_ADD;
+        poll->fd = device.fd;
+        poll->poll32_events = POLLIN;
+        // Not IOSQE_CQE_SKIP_SUCCESS, if the poll fails (e. g. cancelled on
+        // remove) that also skips the completion for the read, and we'd never
+        // get the slot back.
+        poll->flags = IOSQE_IO_LINK;
+        poll->user_data = userData(DevicePoll, slot);
+
+        io_uring_sqe *read = nextSqe();
+        const bool fixed = m_fixedBuffers && slot < FixedBuffers;
+        read->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        read->fd = device.fd;
+        read->addr = reinterpret_cast<uintptr_t>(device.buffer);
+        read->len = BufferSize;
+        read->off = uint64_t(-1); // wherever it is
+        read->buf_index = 0;
+        read->user_data = userData(DeviceRead, slot);
+    }
+
+    void cancel(const uint8_t opcode, const uint64_t target)
+    {
+        reserve(1);
+        io_uring_sqe *sqe = nextSqe();
+        sqe->opcode = opcode;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->flags = m_skipSuccess;
+        sqe->user_data = userData(Cancel, 0);
+    }
+
+    // Handles the completions, and returns how many fds are in readyFds
+    int reap()
+    {
+        int count = 0;
+        uint32_t head = *m_cqHead;
+        const uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail && count < MaxEvents; head++) {
+            const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+            const Type type = Type(cqe.user_data >> 32);
+            const uint32_t index = uint32_t(cqe.user_data);
+
+            int fd = -1;
+            switch(type) {
+            case Poll:
+                if (size_t(index) >= m_fds.size() || !m_fds[index].polled) {
+                    break;
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE) && cqe.res != -ECANCELED) {
+                    // Multishot polls can stop, e. g. if the kernel is short
+                    // on memory, so we need to ask again.
+                    armPoll(index);
+                }
+                if (cqe.res >= 0) {
+                    fd = index;
+                }
+                break;
+            case DeviceRead: {
+                Slot &device = m_slots[index];
+                device.pending = false;
+                if (device.fd == -1) {
+                    // Removed, this was the last thing using the buffer
+                    m_freeSlots.push_back(index);
+                    break;
+                }
+                if (cqe.res == -ECANCELED || cqe.res == -EAGAIN || cqe.res == -EINTR) {
+                    // The poll failed or it was woken up for nothing, try again
+                    armRead(index);
+                    break;
+                }
+                device.result = cqe.res;
+                m_delivered.push_back(index);
+                fd = device.fd;
+                break;
+            }
+            case DevicePoll:
+            case Cancel:
+            default:
+                // Nothing to do, the read tells us what happened
+                break;
+            }
+
+            if (fd != -1 && m_fds[fd].reportedRound != m_round) {
+                m_fds[fd].reportedRound = m_round;
+                readyFds[count++] = fd;
+            }
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    void *m_sqRing = nullptr;
+    void *m_cqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    uint32_t *m_sqHead = nullptr;
+    uint32_t *m_sqTail = nullptr;
+    uint32_t m_sqTailLocal = 0; // not visible to the kernel until we enter
+    uint32_t m_sqMask = 0;
+    uint32_t m_sqEntries = 0;
+
+    uint32_t *m_cqHead = nullptr;
+    uint32_t *m_cqTail = nullptr;
+    uint32_t m_cqMask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+
+    uint8_t m_skipSuccess = 0;
+    bool m_canWaitWithTimeout = false;
+
+    input_event *m_fixedBuffers = nullptr;
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_freeSlots;
+    std::vector<uint32_t> m_delivered;
+
+    // Indexed by fd, they're small and dense
+    std::vector<FdState> m_fds;
+    uint64_t m_round = 0;
+};
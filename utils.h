@@ -1,5 +1,7 @@
 #pragma once
 
+#include "log.h"
+
 extern "C" {
 #include <linux/input.h>
 #include <sys/stat.h>
@@ -8,6 +10,7 @@ extern "C" {
 #include <unistd.h>
 #include <wordexp.h>
 #include <signal.h>
+#include <spawn.h>
 }
 
 namespace std_sux
@@ -32,6 +35,8 @@ namespace std_sux
 
 }// namespace std_sux
 
+// Expands ~ and variables, but doesn't run anything. Returns an empty string
+// if it fails or isn't exactly one path.
 static std::string resolvePath(const std::string &path)
 {
     if (path.empty()) {
@@ -39,57 +44,83 @@ static std::string resolvePath(const std::string &path)
     }
 
     wordexp_t expanded;
-    wordexp(path.c_str(), &expanded, 0);
-    std::string resolved(expanded.we_wordv[0]);
+    const int ret = wordexp(path.c_str(), &expanded, WRDE_NOCMD | WRDE_UNDEF);
+    if (ret != 0) {
+        // Only allocated if it ran out of memory halfway
+        if (ret == WRDE_NOSPACE) {
+            wordfree(&expanded);
+        }
+        return {};
+    }
+    std::string resolved;
+    if (expanded.we_wordc == 1) {
+        resolved = expanded.we_wordv[0];
+    }
     wordfree(&expanded);
 
     return resolved;
 }
 
 
-static void launch(const std::string &command)
+// posix_spawn() attributes and file actions, set up once because setting them
+// up allocates
+struct SpawnSettings
 {
-    if (s_verbose) printf(" -> Launching '%s'\n", command.c_str());
-
-    if (s_dryRun) {
-        return;
+    SpawnSettings()
+    {
+        posix_spawnattr_init(&attributes);
+
+        // SIGCHLD is ignored by us, and ignored signals survive exec
+        sigset_t defaultSignals;
+        sigemptyset(&defaultSignals);
+        sigaddset(&defaultSignals, SIGCHLD);
+        posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+        posix_spawn_file_actions_init(&fileActions);
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 34)
+        // Everything we open is O_CLOEXEC, but just in case libudev or someone
+        // else isn't as careful. This is a single close_range() in the child.
+        posix_spawn_file_actions_addclosefrom_np(&fileActions, 3);
+#endif
+#endif
     }
 
-    const int pid = fork();
-    switch(pid) {
-    case 0: {
-
-        if (s_verbose) printf("Child executing %s\n", command.c_str());
-
-        int maxfd = FD_SETSIZE;
-        struct rlimit rl;
-        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
-            maxfd = rl.rlim_cur;
-        }
-        for (int fd = 3; fd < maxfd; ++fd) {
-            close(fd);
-        }
+    ~SpawnSettings()
+    {
+        posix_spawn_file_actions_destroy(&fileActions);
+        posix_spawnattr_destroy(&attributes);
+    }
 
-        // SIGCHLD will not be reset after fork, unlike all other signals
-        signal(SIGCHLD, SIG_DFL);
+    static const SpawnSettings &get()
+    {
+        static const SpawnSettings settings;
+        return settings;
+    }
 
-        // We use system(), because this is basically what system() is for and
-        // we have trusted data.
-        // Trying to do the same as system() ourselves (like hkd with execvp)
-        // is probably going to break, with manually resolving commands etc.
-        const int ret = std::system(command.c_str());
+    posix_spawnattr_t attributes;
+    posix_spawn_file_actions_t fileActions;
+};
 
-        if (ret != 0 && s_verbose) {
-            perror("Launching failed");
-        }
-        exit(0);
-        break;
+// Starts path with argv, returns the pid or -1 on failure
+static pid_t spawn(const char *path, char *const argv[])
+{
+    if (s_dryRun) {
+        return 0;
     }
-    case -1:
-        perror(" ! Error forking");
-        return;
-    default:
-        if (s_verbose) printf("Forked, parent PID: %d\n", pid);
-        break;
+
+    // posix_spawn() uses a vfork style clone, so we don't pay for copying
+    // the page tables of the whole daemon.
+    const SpawnSettings &settings = SpawnSettings::get();
+    pid_t pid = -1;
+    const int ret = posix_spawn(&pid, path, &settings.fileActions, &settings.attributes, argv, environ);
+    if (ret != 0) {
+        errno = ret;
+        perror(" ! Error launching");
+        return -1;
     }
+
+    if (s_verbose) logPrint("Launched, PID: %d\n", pid);
+    return pid;
 }